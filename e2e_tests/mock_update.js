@@ -5,17 +5,34 @@
 const path = require('path');
 const fs = require('fs');
 
-function writeDepFile(depFilePath, destFilePath, depFilePaths) {
+function getDepFile(destFilePath, depFilePaths) {
   const fileDepList = depFilePaths
     .map(filePath => filePath.replace(/ /g, '\\\\ '))
     .join('\\\n  ');
-  const os = fs.createWriteStream(depFilePath);
-  os.write(`${destFilePath}: ${fileDepList}\n`);
-  os.end();
+  return `${destFilePath}: ${fileDepList}\n`;
 }
 
-(function main() {
-  const sourceFilePaths = process.argv.slice(4);
+/**
+ * Write `size` bytes to `fd`, that can be `Infinity`, to check that these get
+ * read while we run.
+ */
+function writeNoise(fd, size) {
+  const chunk = Buffer.alloc(1 << 16, 'x');
+  for (let written = 0; written < size;) {
+    try {
+      written += fs.writeSync(fd, chunk, 0, Math.min(chunk.length, size - written));
+    } catch (error) {
+      if (error.code !== 'EAGAIN') throw error;
+    }
+  }
+}
+
+/**
+ * Concatenate the sources into the destination, replacing the includes by the
+ * content of the included files. Returns the content of the depfile. Sources
+ * can also ask to write noise to stdout or stderr, or to report a dependency.
+ */
+function update(destFilePath, sourceFilePaths) {
   const depFilePaths = [];
   const sources = sourceFilePaths.map(filePath => {
     const content = fs.readFileSync(filePath, 'utf8');
@@ -23,6 +40,15 @@ function writeDepFile(depFilePath, destFilePath, depFilePaths) {
     const result = [];
     for (let i = 0; i < lines.length; ++i) {
       const line = lines[i];
+      const directive = line.split(' ');
+      if (directive[0] === '#stdout' || directive[0] === '#stderr') {
+        writeNoise(directive[0] === '#stdout' ? 1 : 2, Number(directive[1]));
+        continue;
+      }
+      if (directive[0] === '#depend') {
+        depFilePaths.push(directive[1]);
+        continue;
+      }
       const inc = "#include ";
       if (line.substring(0, inc.length) === inc) {
         const incName = line.substring(inc.length);
@@ -40,9 +66,48 @@ function writeDepFile(depFilePath, destFilePath, depFilePaths) {
   const result = [
     '# GENERATED FILE\n',
   ].concat(sources).join('');
-  const destFilePath = process.argv[2];
-  const os = fs.createWriteStream(destFilePath);
-  os.write(result);
-  os.end();
-  writeDepFile(process.argv[3], destFilePath, depFilePaths);
+  fs.writeFileSync(destFilePath, result);
+  return getDepFile(destFilePath, depFilePaths);
+}
+
+function writeResponse(exitCode, diagnostics, depFile) {
+  const diagBuffer = Buffer.from(diagnostics, 'utf8');
+  const depBuffer = Buffer.from(depFile, 'utf8');
+  const header = Buffer.alloc(12);
+  header.writeUInt32LE(8 + diagBuffer.length + depBuffer.length, 0);
+  header.writeUInt32LE(exitCode, 4);
+  header.writeUInt32LE(diagBuffer.length, 8);
+  process.stdout.write(Buffer.concat([header, diagBuffer, depBuffer]));
+}
+
+/**
+ * Run as a persistent worker: each request holds the arguments that would
+ * otherwise be given on the command line, with "-" as the depfile.
+ */
+function runWorker() {
+  let pending = Buffer.alloc(0);
+  process.stdin.on('data', chunk => {
+    pending = Buffer.concat([pending, chunk]);
+    while (pending.length >= 4) {
+      const size = pending.readUInt32LE(0);
+      if (pending.length < 4 + size) break;
+      const args = pending.slice(4, 4 + size).toString('utf8').split('\0');
+      args.pop();
+      pending = pending.slice(4 + size);
+      try {
+        writeResponse(0, '', update(args[0], args.slice(2)));
+      } catch (error) {
+        writeResponse(1, `${error.message}\n`, '');
+      }
+    }
+  });
+}
+
+(function main() {
+  if (process.argv[2] === '--worker') {
+    runWorker();
+    return;
+  }
+  const depFile = update(process.argv[2], process.argv.slice(4));
+  fs.writeFileSync(process.argv[3], depFile);
 })();
@@ -34,6 +34,31 @@ function runUpd(args) {
   return result.stdout;
 }
 
+/**
+ * Like `runUpd`, but returns the result even if upd fails, along with what it
+ * wrote to stderr. Upd getting stuck counts as a failure of the test.
+ */
+function runUpdWithStderr(args) {
+  const result = child_process.spawnSync(
+    path.resolve(__dirname, '../dist/upd'),
+    args,
+    {
+      cwd: ROOT_PATH,
+      stdio: ['pipe', 'pipe', 'pipe'],
+      timeout: 60000,
+      killSignal: 'SIGKILL',
+      maxBuffer: 1 << 26,
+    }
+  );
+  if (result.error != null) {
+    throw result.error;
+  }
+  if (result.signal != null) {
+    throw Error(`upd exited with signal ${result.signal}`);
+  }
+  return result;
+}
+
 function runTestSuite() {
   rimraf.sync(ROOT_PATH);
   fs.mkdirSync(ROOT_PATH);
@@ -56,6 +81,13 @@ function runTestSuite() {
             "variables": ["output_file", "depfile", "input_files"]
           }
         ]
+      },
+      {
+        "binary_path": nodePath,
+        "arguments": [
+          {"variables": ["output_file", "depfile", "input_files"]}
+        ],
+        "worker_arguments": ["../mock_update.js", "--worker"]
       }
     ],
     "source_patterns": ["src/(**/*).in"],
@@ -64,6 +96,11 @@ function runTestSuite() {
         "command_line_ix": 0,
         "inputs": [{"source_ix": 0}],
         "output": "dist/result.out"
+      },
+      {
+        "command_line_ix": 1,
+        "inputs": [{"source_ix": 0}],
+        "output": "dist/worker_result.out"
       }
     ]
   }, null, 2));
@@ -73,15 +110,76 @@ function runTestSuite() {
   fs.writeFileSync(path.join(srcDir, 'bar.in'), 'This is bar.\n');
   fs.mkdirSync(path.join(srcDir, 'sub'));
   fs.writeFileSync(path.join(srcDir, 'sub', 'glo.in'), 'This is glo.\n');
-  runUpd(['update', 'dist/result.out']);
+  runUpd(['update', 'dist/result.out', 'dist/worker_result.out']);
   expectToMatchSnapshot('first_result', path.join(ROOT_PATH, 'dist/result.out'));
+  expectToMatchSnapshot('first_result', path.join(ROOT_PATH, 'dist/worker_result.out'));
   fs.writeFileSync(path.join(srcDir, 'foo.h'), 'Foo header.\n');
   fs.writeFileSync(path.join(srcDir, 'foo.in'), '#include foo.h\nThis is foo, second.\n');
-  runUpd(['update', 'dist/result.out']);
+  runUpd(['update', 'dist/result.out', 'dist/worker_result.out']);
   expectToMatchSnapshot('include_header_result', path.join(ROOT_PATH, 'dist/result.out'));
+  expectToMatchSnapshot('include_header_result', path.join(ROOT_PATH, 'dist/worker_result.out'));
   fs.writeFileSync(path.join(srcDir, 'foo.h'), 'Foo header, modified.\n');
-  runUpd(['update', 'dist/result.out']);
+  runUpd(['update', 'dist/result.out', 'dist/worker_result.out']);
   expectToMatchSnapshot('header_modified_result', path.join(ROOT_PATH, 'dist/result.out'));
+  expectToMatchSnapshot('header_modified_result', path.join(ROOT_PATH, 'dist/worker_result.out'));
+  runNoisyTestSuite(nodePath);
+}
+
+/**
+ * Run several updates at a time that write a lot on stdout and stderr, more
+ * than pipes can hold, so that we have to keep reading while they run.
+ */
+function runNoisyTestSuite(nodePath) {
+  fs.writeFileSync(UPDFILE, JSON.stringify({
+    "command_line_templates": [
+      {
+        "binary_path": nodePath,
+        "arguments": [
+          {
+            "literals": ["../mock_update.js"],
+            "variables": ["output_file", "depfile", "input_files"]
+          }
+        ]
+      }
+    ],
+    "source_patterns": ["noisy/(*).in"],
+    "rules": [
+      {
+        "command_line_ix": 0,
+        "inputs": [{"source_ix": 0}],
+        "output": "noisy/$1.out"
+      }
+    ]
+  }, null, 2));
+  const noisyDir = path.join(ROOT_PATH, 'noisy');
+  fs.mkdirSync(noisyDir);
+  const names = ['a', 'b', 'c', 'd'];
+  const noiseSize = 1 << 18;
+  for (const name of names) {
+    fs.writeFileSync(path.join(noisyDir, `${name}.in`), `#stderr ${noiseSize}\nThis is ${name}.\n`);
+  }
+  let result = runUpdWithStderr(['update', '--all', '--concurrency', '4']);
+  if (result.status != 0) {
+    throw Error(`upd exited with code ${result.status}`);
+  }
+  const noise = result.stderr.toString('utf8').replace(/[^x]/g, '');
+  if (noise.length !== names.length * noiseSize) {
+    throw Error(`expected ${names.length * noiseSize} bytes of noise, got ${noise.length}`);
+  }
+
+  // Once an error stops the update, processes that never stop writing must
+  // still terminate, so that we do too.
+  fs.writeFileSync(path.join(noisyDir, 'a.in'), '#stdout Infinity\n');
+  fs.writeFileSync(path.join(noisyDir, 'b.in'), '#stderr Infinity\n');
+  fs.writeFileSync(path.join(noisyDir, 'c.in'), '#stderr Infinity\n');
+  fs.writeFileSync(path.join(noisyDir, 'd.in'), '#depend noisy/a.out\n');
+  result = runUpdWithStderr(['update', '--all', '--concurrency', '4']);
+  if (result.status != 2) {
+    throw Error(`upd exited with code ${result.status}, expected 2`);
+  }
+  if (!/depend on the generated file `noisy\/a.out'/.test(result.stderr.toString('utf8'))) {
+    throw Error('upd did not report the undeclared dependency');
+  }
 }
 
 function resolveBinary(name) {
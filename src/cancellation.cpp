@@ -0,0 +1,62 @@
+#include "cancellation.h"
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+
+namespace upd {
+
+/**
+ * Only lock-free atomics are safe to use from a signal handler.
+ */
+static std::atomic<int> cancellation_signal(0);
+static std::atomic<size_t> cancellation_count(0);
+static std::atomic<int> cancellation_wake_fd(-1);
+
+void request_cancellation(int sig) {
+  int none = 0;
+  cancellation_signal.compare_exchange_strong(none, sig);
+  // Only the first two signals change anything, so we don't need to write
+  // more, that could end up blocking once the pipe is full.
+  if (++cancellation_count > 2) return;
+  int fd = cancellation_wake_fd;
+  if (fd < 0) return;
+  char c = 0;
+  auto saved_errno = errno;
+  auto written = ::write(fd, &c, 1);
+  (void)written;
+  errno = saved_errno;
+}
+
+int get_cancellation_signal() { return cancellation_signal; }
+
+size_t get_cancellation_count() { return cancellation_count; }
+
+void reset_cancellation() {
+  cancellation_signal = 0;
+  cancellation_count = 0;
+}
+
+void set_cancellation_wake_fd(int fd) { cancellation_wake_fd = fd; }
+
+static void handle_signal(int sig) { request_cancellation(sig); }
+
+/**
+ * Blocking calls on other threads, such as the ones reading the output of
+ * processes, must not fail with `EINTR` because of us, so they get restarted.
+ * `epoll_wait` is never restarted, so the update loop still notices.
+ */
+cancellation_handlers::cancellation_handlers() {
+  struct ::sigaction action = {};
+  action.sa_handler = &handle_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  ::sigaction(SIGINT, &action, &previous_int_);
+  ::sigaction(SIGTERM, &action, &previous_term_);
+}
+
+cancellation_handlers::~cancellation_handlers() {
+  ::sigaction(SIGINT, &previous_int_, nullptr);
+  ::sigaction(SIGTERM, &previous_term_, nullptr);
+}
+
+} // namespace upd
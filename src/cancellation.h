@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <signal.h>
+
+namespace upd {
+
+/**
+ * Record that we were asked to stop, as if we received the signal `sig`. Only
+ * the first signal is kept, but each one is counted, so that we can stop more
+ * abruptly on the second one. This is what the handlers of `SIGINT` and
+ * `SIGTERM` call, so it is safe to call from a signal handler, or from any
+ * thread.
+ */
+void request_cancellation(int sig);
+
+/**
+ * The signal we were asked to stop with, or zero if we weren't.
+ */
+int get_cancellation_signal();
+
+/**
+ * How many times we were asked to stop.
+ */
+size_t get_cancellation_count();
+
+/**
+ * Forget about any request to stop. This is only meant for tests.
+ */
+void reset_cancellation();
+
+/**
+ * Have `request_cancellation` write a byte on that file descriptor, so that
+ * a thread waiting for it to be readable wakes up. A negative value stops
+ * that.
+ */
+void set_cancellation_wake_fd(int fd);
+
+/**
+ * Install the handlers of `SIGINT` and `SIGTERM` that request cancellation,
+ * and restore the previous ones when destroyed.
+ */
+struct cancellation_handlers {
+  cancellation_handlers();
+  cancellation_handlers(cancellation_handlers &) = delete;
+  ~cancellation_handlers();
+
+private:
+  struct ::sigaction previous_int_;
+  struct ::sigaction previous_term_;
+};
+
+} // namespace upd
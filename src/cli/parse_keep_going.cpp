@@ -0,0 +1,18 @@
+#include "parse_keep_going.h"
+#include <sstream>
+
+namespace upd {
+namespace cli {
+
+size_t parse_keep_going(const std::string &str) {
+  std::istringstream iss(str);
+  size_t result;
+  iss >> result;
+  if (str.empty() || str[0] == '-' || iss.fail() || !iss.eof()) {
+    throw invalid_keep_going_error(str);
+  }
+  return result;
+}
+
+} // namespace cli
+} // namespace upd
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+namespace upd {
+namespace cli {
+
+struct invalid_keep_going_error {
+  invalid_keep_going_error(const std::string &value_) : value(value_) {}
+  const std::string value;
+};
+
+/**
+ * Parse how many updates can fail before we stop starting new ones. Zero
+ * means there is no limit.
+ */
+size_t parse_keep_going(const std::string &str);
+
+} // namespace cli
+} // namespace upd
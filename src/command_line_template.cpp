@@ -45,10 +45,38 @@ void reify_command_line_arg(reify_state &state, std::vector<std::string> &args,
   }
 }
 
-command_line reify_command_line(const command_line_template &base,
-                                const command_line_parameters &parameters,
-                                const std::string &root_path,
-                                const std::string &working_path) {
+bool has_variable(const command_line_template &base,
+                  command_line_template_variable variable) {
+  for (auto const &part : base.parts) {
+    for (auto const &variable_arg : part.variable_args) {
+      if (variable_arg == variable) return true;
+    }
+  }
+  return false;
+}
+
+std::string get_response_file_content(const std::vector<std::string> &args) {
+  std::string content;
+  for (auto const &arg : args) {
+    if (arg.empty()) content.append("\"\"");
+    for (auto c : arg) {
+      if (c == ' ' || c == '\t' || c == '\n' || c == '\\' || c == '\'' ||
+          c == '"') {
+        content.push_back('\\');
+      }
+      content.push_back(c);
+    }
+    content.push_back('\n');
+  }
+  return content;
+}
+
+command_line
+reify_command_line(const command_line_template &base,
+                   const command_line_parameters &parameters,
+                   const std::string &root_path,
+                   const std::string &working_path,
+                   const response_file_writer &write_response_file) {
   command_line result;
   result.binary_path = base.binary_path;
   result.environment = base.environment;
@@ -60,10 +88,17 @@ command_line reify_command_line(const command_line_template &base,
     for (auto const &literal_arg : part.literal_args) {
       result.args.push_back(literal_arg);
     }
+    bool to_response_file = part.uses_response_file && write_response_file;
+    std::vector<std::string> response_file_args;
+    auto &args = to_response_file ? response_file_args : result.args;
     for (auto const &variable_arg : part.variable_args) {
-      reify_command_line_arg(state, result.args, variable_arg, parameters,
-                             root_path, working_path);
+      reify_command_line_arg(state, args, variable_arg, parameters, root_path,
+                             working_path);
     }
+    if (!to_response_file) continue;
+    result.args.push_back(
+        part.response_file_prefix +
+        write_response_file(get_response_file_content(response_file_args)));
   }
   return result;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "inspect.h"
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -30,16 +31,32 @@ inline std::string inspect(command_line_template_variable value,
 /**
  * Describe a subsequence of a command line's arguments. It starts with a
  * sequence of literals, followed by a sequence of variables.
+ *
+ * If the part uses a response file, the variables are replaced by a single
+ * argument instead, that is `response_file_prefix` followed by the path of a
+ * file that contains what the variables expand to. For example, with "@" as
+ * prefix, the list of input files of a link command can be of any size, and
+ * is given as "@/path/to/file".
  */
 struct command_line_template_part {
-  command_line_template_part() {}
+  command_line_template_part() : uses_response_file(false) {}
   command_line_template_part(
       std::vector<std::string> literal_args_,
       std::vector<command_line_template_variable> variable_args_)
-      : literal_args(literal_args_), variable_args(variable_args_) {}
+      : literal_args(literal_args_), variable_args(variable_args_),
+        uses_response_file(false) {}
+  command_line_template_part(
+      std::vector<std::string> literal_args_,
+      std::vector<command_line_template_variable> variable_args_,
+      std::string response_file_prefix_)
+      : literal_args(literal_args_), variable_args(variable_args_),
+        uses_response_file(true), response_file_prefix(response_file_prefix_) {
+  }
 
   std::vector<std::string> literal_args;
   std::vector<command_line_template_variable> variable_args;
+  bool uses_response_file;
+  std::string response_file_prefix;
 };
 
 template <> struct type_info<command_line_template_part> {
@@ -49,7 +66,9 @@ template <> struct type_info<command_line_template_part> {
 inline bool operator==(const command_line_template_part &left,
                        const command_line_template_part &right) {
   return left.literal_args == right.literal_args &&
-         left.variable_args == right.variable_args;
+         left.variable_args == right.variable_args &&
+         left.uses_response_file == right.uses_response_file &&
+         left.response_file_prefix == right.response_file_prefix;
 }
 
 inline std::string inspect(const command_line_template_part &value,
@@ -57,6 +76,8 @@ inline std::string inspect(const command_line_template_part &value,
   collection_inspector insp("upd::command_line_template_part", options);
   insp.push_back("literal_args", value.literal_args);
   insp.push_back("variable_args", value.variable_args);
+  insp.push_back("uses_response_file", value.uses_response_file);
+  insp.push_back("response_file_prefix", value.response_file_prefix);
   return insp.result();
 }
 
@@ -81,6 +102,20 @@ struct command_line_template {
   std::string binary_path;
   std::vector<command_line_template_part> parts;
   environment_t environment;
+  /**
+   * Whether the tool runs as a persistent worker: rather than starting a
+   * process for each update, we start it once with `worker_args`, and send it
+   * the arguments of each update as a request (see "tool_process.h").
+   */
+  bool persistent_worker;
+  std::vector<std::string> worker_args;
+  /**
+   * Whether the updates of the template take their slots from one of the
+   * pools of the manifest, in which case no more of these run at a time than
+   * what that pool allows, on top of the global concurrency.
+   */
+  bool has_pool;
+  size_t pool_ix;
 };
 
 template <> struct type_info<command_line_template> {
@@ -90,7 +125,10 @@ template <> struct type_info<command_line_template> {
 inline bool operator==(const command_line_template &left,
                        const command_line_template &right) {
   return left.binary_path == right.binary_path && left.parts == right.parts &&
-         left.environment == right.environment;
+         left.environment == right.environment &&
+         left.persistent_worker == right.persistent_worker &&
+         left.worker_args == right.worker_args &&
+         left.has_pool == right.has_pool && left.pool_ix == right.pool_ix;
 }
 
 inline std::string inspect(const command_line_template &value,
@@ -99,6 +137,10 @@ inline std::string inspect(const command_line_template &value,
   insp.push_back("binary_path", value.binary_path);
   insp.push_back("parts", value.parts);
   insp.push_back("environment", value.environment);
+  insp.push_back("persistent_worker", value.persistent_worker);
+  insp.push_back("worker_args", value.worker_args);
+  insp.push_back("has_pool", value.has_pool);
+  insp.push_back("pool_ix", value.pool_ix);
   return insp.result();
 }
 
@@ -179,11 +221,36 @@ struct command_line_parameters {
 };
 
 /**
- * Specialize a command line template for a particular set of files.
+ * Whether any argument of the template is that variable.
+ */
+bool has_variable(const command_line_template &base,
+                  command_line_template_variable variable);
+
+/**
+ * Write the arguments of a part that uses a response file to a new file, and
+ * return its path.
+ */
+typedef std::function<std::string(const std::string &content)>
+    response_file_writer;
+
+/**
+ * Get the content of a response file that has these arguments, one per line,
+ * in the format that GCC and Clang expect. Characters that would otherwise
+ * separate or quote arguments are escaped with a backslash, and empty
+ * arguments are quoted.
+ */
+std::string get_response_file_content(const std::vector<std::string> &args);
+
+/**
+ * Specialize a command line template for a particular set of files. Parts
+ * that use a response file get their arguments written with
+ * `write_response_file`. Without it, the arguments are given directly, as if
+ * the part didn't use a response file.
  */
-command_line reify_command_line(const command_line_template &base,
-                                const command_line_parameters &parameters,
-                                const std::string &root_path,
-                                const std::string &working_path);
+command_line reify_command_line(
+    const command_line_template &base,
+    const command_line_parameters &parameters, const std::string &root_path,
+    const std::string &working_path,
+    const response_file_writer &write_response_file = response_file_writer());
 
 } // namespace upd
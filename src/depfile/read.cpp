@@ -13,8 +13,8 @@ namespace depfile {
  * State machine that updates the depfile data for each type of token.
  */
 struct parse_token_handler {
-  parse_token_handler(std::unique_ptr<depfile_data> &data)
-      : data_(data), state_(state_t::read_target) {}
+  parse_token_handler(std::vector<depfile_data> &rules)
+      : rules_(rules), state_(state_t::read_target) {}
   bool end();
   bool colon();
   bool string(const std::string &file_path);
@@ -22,7 +22,7 @@ struct parse_token_handler {
 
 private:
   enum class state_t { read_target, read_colon, read_dep, done };
-  std::unique_ptr<depfile_data> &data_;
+  std::vector<depfile_data> &rules_;
   state_t state_;
 };
 
@@ -44,21 +44,20 @@ bool parse_token_handler::colon() {
 }
 
 bool parse_token_handler::string(const std::string &file_path) {
-  if (state_ == state_t::read_target) {
-    data_.reset(new depfile_data());
-    data_->target_path = file_path;
+  if (state_ == state_t::read_target || state_ == state_t::done) {
+    rules_.push_back({file_path, {}});
     state_ = state_t::read_colon;
     return true;
   }
   if (state_ == state_t::read_dep) {
-    data_->dependency_paths.push_back(file_path);
+    rules_.back().dependency_paths.push_back(file_path);
     return true;
   }
   throw parse_error("unexpected string `" + file_path + "`");
 }
 
 bool parse_token_handler::new_line() {
-  if (state_ == state_t::read_target) {
+  if (state_ == state_t::read_target || state_ == state_t::done) {
     return true;
   }
   if (state_ != state_t::read_dep) {
@@ -69,13 +68,25 @@ bool parse_token_handler::new_line() {
 }
 
 template <typename CharReader>
-std::unique_ptr<depfile_data> parse(CharReader &char_reader) {
-  std::unique_ptr<depfile_data> data;
+std::vector<depfile_data> parse_rules(CharReader &char_reader) {
+  std::vector<depfile_data> rules;
   tokenizer<CharReader> tokens(char_reader);
-  parse_token_handler handler(data);
+  parse_token_handler handler(rules);
   while (tokens.template next<parse_token_handler, bool>(handler))
     ;
-  return data;
+  return rules;
+}
+
+template std::vector<depfile_data> parse_rules(string_char_reader &);
+
+template <typename CharReader>
+std::unique_ptr<depfile_data> parse(CharReader &char_reader) {
+  auto rules = parse_rules(char_reader);
+  if (rules.empty()) return nullptr;
+  if (rules.size() > 1) {
+    throw parse_error("unexpected string `" + rules[1].target_path + "`");
+  }
+  return std::make_unique<depfile_data>(std::move(rules[0]));
 }
 
 template std::unique_ptr<depfile_data> parse(string_char_reader &);
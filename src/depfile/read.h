@@ -12,10 +12,9 @@ namespace upd {
 namespace depfile {
 
 /**
- * Right now, only a single pair is accepted in depfiles, and the `target_path`
- * is expected to be the file being built. Additionally, only one `target_path`
- * is accepted. Eventually we may accept several `target_path` builts at the
- * same time.
+ * A rule of a depfile, that is a `target_path` and what it depends on. Only
+ * one `target_path` is accepted per rule, but a depfile may have a rule for
+ * each of the files that a command updates (see `parse_rules`).
  */
 struct depfile_data {
   std::string target_path;
@@ -45,15 +44,27 @@ private:
  *       another_header.h
  *
  * If the stream only has whitespace, this is considered valid but will return
- * an empty pointer. Technically, several lines of "target: dependencies" would
- * be valid syntax, so this function may be improved to return a vector of
- * these instead.
+ * an empty pointer. Only a single rule is accepted.
  */
 template <typename CharReader>
 std::unique_ptr<depfile_data> parse(CharReader &char_reader);
 
 extern template std::unique_ptr<depfile_data> parse(upd::string_char_reader &);
 
+/**
+ * Parse a depfile that may have several lines of "target: dependencies", for
+ * example because a single command updated several files. Ex:
+ *
+ *     foo.o: foo.cpp foo.h
+ *     bar.o: bar.cpp
+ *
+ */
+template <typename CharReader>
+std::vector<depfile_data> parse_rules(CharReader &char_reader);
+
+extern template std::vector<depfile_data>
+parse_rules(upd::string_char_reader &);
+
 /**
  * Read the specified file as a depfile.
  */
@@ -1,4 +1,5 @@
 #include "execute_manifest.h"
+#include "cancellation.h"
 #include "gen_update_map.h"
 #include "manifest/read_from_file.h"
 #include "output_dot_graph.h"
@@ -6,17 +7,75 @@
 #include "path.h"
 #include "update.h"
 #include "update_plan.h"
+#include "update_log/upgrade.h"
 
 namespace upd {
 
 static const std::string CACHE_FOLDER = ".upd";
 
+static std::string get_cache_file_path(const std::string &root_path,
+                                       const std::string &name) {
+  return root_path + "/" + CACHE_FOLDER + "/" + name;
+}
+
+static void create_cache_folder(const std::string &root_path) {
+  if (io::mkdir((root_path + "/" + CACHE_FOLDER).c_str(), 0700) != 0 &&
+      errno != EEXIST) {
+    throw std::runtime_error("cannot create upd hidden directory");
+  }
+}
+
+/**
+ * Forget about the files that no rule generates anymore, so that the update
+ * log doesn't grow forever as rules come and go.
+ */
+static void drop_stale_records(update_log::cache &log_cache,
+                               const update_map &updm) {
+  log_cache.drop_records([&updm](const std::string &local_path) {
+    return updm.output_files_by_path.count(local_path) == 0;
+  });
+}
+
+/**
+ * Forget the hashes of the files that neither the manifest nor the records
+ * of the update log refer to anymore, such as headers that got renamed, and
+ * the ones of files that don't exist anymore.
+ */
+static void drop_stale_hashes(file_hash_cache &hash_cache,
+                              const std::string &root_path,
+                              const update_map &updm,
+                              update_log::cache &log_cache) {
+  std::unordered_set<std::string> local_paths;
+  for (auto const &entry : updm.output_files_by_path) {
+    auto const &file = entry.second;
+    local_paths.insert(file.local_output_paths.begin(),
+                       file.local_output_paths.end());
+    local_paths.insert(file.local_input_file_paths.begin(),
+                       file.local_input_file_paths.end());
+    for (auto const &group : file.dependency_groups) {
+      local_paths.insert(group.begin(), group.end());
+    }
+  }
+  for (auto const &entry : log_cache.records()) {
+    for (auto ent_id : entry.second.dependency_ent_ids) {
+      local_paths.insert(log_cache.ents().get_path(ent_id));
+    }
+  }
+  auto prefix = root_path + '/';
+  hash_cache.drop_entries([&](const std::string &file_path) {
+    if (file_path.compare(0, prefix.size(), prefix) != 0) return true;
+    if (local_paths.count(file_path.substr(prefix.size())) == 0) return true;
+    struct ::stat data;
+    return io::stat(file_path.c_str(), &data) != 0;
+  });
+}
+
 void execute_manifest(const std::string &root_path,
                       const std::string &working_path, bool print_graph,
                       bool update_all_files,
                       const std::vector<std::string> &relative_target_paths,
                       bool print_commands, bool print_shell_script,
-                      size_t concurrency) {
+                      size_t concurrency, size_t failure_limit) {
   auto manifest = manifest::read_from_file(root_path);
   const update_map updm = gen_update_map(root_path, manifest);
   const auto &output_files_by_path = updm.output_files_by_path;
@@ -50,28 +109,80 @@ void execute_manifest(const std::string &root_path,
     return;
   }
 
-  if (io::mkdir((root_path + "/" + CACHE_FOLDER).c_str(), 0700) != 0 &&
-      errno != EEXIST) {
-    throw std::runtime_error("cannot create upd hidden directory");
-  }
-
-  std::string log_file_path = root_path + "/" + CACHE_FOLDER + "/log";
-  std::string temp_log_file_path =
-      root_path + "/" + CACHE_FOLDER + "/log_rewritten";
+  create_cache_folder(root_path);
+  auto log_file_path = get_cache_file_path(root_path, "log");
+  auto temp_log_file_path = get_cache_file_path(root_path, "log_rewritten");
+  auto hashes_file_path = get_cache_file_path(root_path, "hashes");
+  auto temp_hashes_file_path =
+      get_cache_file_path(root_path, "hashes_rewritten");
 
+  update_log::upgrade_file(log_file_path, temp_log_file_path);
   update_context cx = {
       root_path,         update_log::cache::from_log_file(log_file_path),
       file_hash_cache(), directory_cache<io::mkdir>(root_path),
-      print_commands,    concurrency};
-  execute_update_plan(cx, updm, plan, manifest.command_line_templates);
+      print_commands,    concurrency,
+      failure_limit,
+      scratch_dir(get_cache_file_path(root_path, "scratch.XXXXXX"))};
+  cx.hash_cache.load(hashes_file_path);
+  // Once asked to stop, we still save what got updated so far, so that it
+  // doesn't need to be updated again next time.
+  cancellation_handlers handlers;
+  execute_update_plan(cx, updm, plan, manifest.command_line_templates,
+                      manifest.pools);
 
   cx.log_cache.close();
-  update_log::rewrite_file(log_file_path, temp_log_file_path,
-                           cx.log_cache.records());
+  drop_stale_records(cx.log_cache, updm);
+  if (cx.log_cache.needs_compaction()) {
+    update_log::rewrite_file(log_file_path, temp_log_file_path,
+                             cx.log_cache.records(), cx.log_cache.ents());
+  }
+  cx.hash_cache.save(hashes_file_path, temp_hashes_file_path);
 
+  auto cancellation_signal = get_cancellation_signal();
+  if (cancellation_signal != 0) {
+    throw update_cancelled_error(cancellation_signal);
+  }
   if (!plan.pending_output_file_paths.empty()) {
     throw update_failed_error();
   }
 }
 
+void collect_garbage(const std::string &root_path) {
+  auto manifest = manifest::read_from_file(root_path);
+  const update_map updm = gen_update_map(root_path, manifest);
+  create_cache_folder(root_path);
+  auto log_file_path = get_cache_file_path(root_path, "log");
+  auto temp_log_file_path = get_cache_file_path(root_path, "log_rewritten");
+  update_log::upgrade_file(log_file_path, temp_log_file_path);
+  auto log_cache = update_log::cache::from_log_file(log_file_path);
+  log_cache.close();
+  auto hashes_file_path = get_cache_file_path(root_path, "hashes");
+  auto temp_hashes_file_path =
+      get_cache_file_path(root_path, "hashes_rewritten");
+  file_hash_cache hash_cache;
+  hash_cache.load(hashes_file_path);
+  for (auto const &entry : log_cache.records()) {
+    auto const &local_path = entry.first;
+    if (updm.output_files_by_path.count(local_path) > 0) continue;
+    auto file_path = root_path + '/' + local_path;
+    try {
+      if (hash_cache.hash(file_path) != entry.second.hash) {
+        std::cout << "keeping: " << local_path
+                  << " (changed since it was generated)" << std::endl;
+        continue;
+      }
+    } catch (const std::system_error &error) {
+      if (error.code() != std::errc::no_such_file_or_directory) throw;
+      continue;
+    }
+    std::cout << "deleting: " << local_path << std::endl;
+    if (io::unlink(file_path.c_str()) != 0) io::throw_errno();
+  }
+  drop_stale_records(log_cache, updm);
+  update_log::rewrite_file(log_file_path, temp_log_file_path,
+                           log_cache.records(), log_cache.ents());
+  drop_stale_hashes(hash_cache, root_path, updm, log_cache);
+  hash_cache.save(hashes_file_path, temp_hashes_file_path);
+}
+
 } // namespace upd
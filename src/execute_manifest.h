@@ -15,11 +15,26 @@ struct no_targets_error {};
 
 struct update_failed_error {};
 
+/**
+ * Thrown once the updates stopped because we received that signal, after
+ * the update log and hashes were saved.
+ */
+struct update_cancelled_error {
+  update_cancelled_error(int signal_) : signal(signal_) {}
+  const int signal;
+};
+
 void execute_manifest(const std::string &root_path,
                       const std::string &working_path, bool print_graph,
                       bool update_all_files,
                       const std::vector<std::string> &relative_target_paths,
                       bool print_commands, bool print_shell_script,
-                      size_t concurrency);
+                      size_t concurrency, size_t failure_limit);
+
+/**
+ * Delete the files that were generated by rules that don't exist anymore, and
+ * forget about them. Files that changed since they were generated are kept.
+ */
+void collect_garbage(const std::string &root_path);
 
 } // namespace upd
@@ -31,18 +31,33 @@ crawl_source_patterns(const std::string &root_path,
   return matches;
 }
 
+/**
+ * Get the files that an input of the rule `rule_ix` stands for. When the
+ * input is another rule, these are the files of one of its outputs.
+ */
+static const std::vector<captured_string> &
+get_input_captures(const manifest::update_rule_input &input, size_t rule_ix,
+                   const captures_t &matches,
+                   const std::vector<captures_t> &rule_captured_paths) {
+  if (input.type == manifest::input_type::source) {
+    return matches[input.input_ix];
+  }
+  if (input.input_ix >= rule_ix) throw cannot_refer_to_later_rule_error();
+  const auto &output_captures = rule_captured_paths[input.input_ix];
+  if (input.output_ix >= output_captures.size()) {
+    throw unknown_rule_output_error{rule_ix, input.input_ix, input.output_ix};
+  }
+  return output_captures[input.output_ix];
+}
+
 static std::vector<std::vector<std::string>>
 group_dependencies(const std::vector<manifest::update_rule_input> &deps,
                    size_t rule_ix, const captures_t &matches,
-                   const captures_t &rule_captured_paths) {
+                   const std::vector<captures_t> &rule_captured_paths) {
   std::vector<std::vector<std::string>> result;
   for (const auto &dep : deps) {
-    if (dep.type == manifest::input_type::rule) {
-      if (dep.input_ix >= rule_ix) throw cannot_refer_to_later_rule_error();
-    }
-    const auto &input_captures = dep.type == manifest::input_type::source
-                                     ? matches[dep.input_ix]
-                                     : rule_captured_paths[dep.input_ix];
+    const auto &input_captures =
+        get_input_captures(dep, rule_ix, matches, rule_captured_paths);
     std::vector<std::string> values;
     for (const auto &input_capture : input_captures) {
       values.push_back(input_capture.value);
@@ -55,15 +70,11 @@ group_dependencies(const std::vector<manifest::update_rule_input> &deps,
 static std::vector<std::string>
 flatten_dependencies(const std::vector<manifest::update_rule_input> &deps,
                      size_t rule_ix, const captures_t &matches,
-                     const captures_t &rule_captured_paths) {
+                     const std::vector<captures_t> &rule_captured_paths) {
   std::vector<std::string> result;
   for (const auto &dep : deps) {
-    if (dep.type == manifest::input_type::rule) {
-      if (dep.input_ix >= rule_ix) throw cannot_refer_to_later_rule_error();
-    }
-    const auto &input_captures = dep.type == manifest::input_type::source
-                                     ? matches[dep.input_ix]
-                                     : rule_captured_paths[dep.input_ix];
+    const auto &input_captures =
+        get_input_captures(dep, rule_ix, matches, rule_captured_paths);
     for (const auto &input_capture : input_captures) {
       result.push_back(input_capture.value);
     }
@@ -71,58 +82,112 @@ flatten_dependencies(const std::vector<manifest::update_rule_input> &deps,
   return result;
 }
 
+/**
+ * The files that a single command of a rule updates, and the inputs it
+ * takes. The outputs are in the same order as the patterns of the rule.
+ */
+struct rule_command_data {
+  std::vector<std::string> local_input_paths;
+  std::vector<substitution::resolved> outputs;
+};
+
+static bool have_same_values(const std::vector<substitution::resolved> &left,
+                             const std::vector<substitution::resolved> &right) {
+  for (size_t i = 0; i < left.size(); ++i) {
+    if (left[i].value != right[i].value) return false;
+  }
+  return true;
+}
+
+/**
+ * Templates refer to pools by index, so we make sure these exist before we
+ * schedule anything.
+ */
+static void check_pools(const manifest::manifest &manifest) {
+  for (size_t i = 0; i < manifest.pools.size(); ++i) {
+    if (manifest.pools[i].concurrency == 0) throw empty_pool_error{i};
+  }
+  for (size_t i = 0; i < manifest.command_line_templates.size(); ++i) {
+    auto const &tpl = manifest.command_line_templates[i];
+    if (tpl.has_pool && tpl.pool_ix >= manifest.pools.size()) {
+      throw unknown_pool_error{i, tpl.pool_ix};
+    }
+  }
+}
+
 update_map gen_update_map(const std::string &root_path,
                           const manifest::manifest &manifest) {
+  check_pools(manifest);
   update_map result;
   auto matches = crawl_source_patterns(root_path, manifest.source_patterns);
-  std::vector<std::vector<captured_string>> rule_captured_paths(
-      manifest.rules.size());
+  std::vector<captures_t> rule_captured_paths(manifest.rules.size());
   std::unordered_map<std::string, size_t> rule_ids_by_output_path;
   for (size_t i = 0; i < manifest.rules.size(); ++i) {
     const auto &rule = manifest.rules[i];
-    std::unordered_map<std::string,
-                       std::pair<std::vector<std::string>, std::vector<size_t>>>
-        data_by_path;
+    if (rule.outputs.empty()) throw missing_rule_output_error{i};
+    // Inputs that resolve to the same first output are updated by the same
+    // command, so they must resolve to the same other outputs as well.
+    std::unordered_map<std::string, rule_command_data> data_by_path;
     for (const auto &input : rule.inputs) {
-      if (input.type == manifest::input_type::rule) {
-        if (input.input_ix >= i) {
-          throw cannot_refer_to_later_rule_error();
-        }
-      }
-      const auto &input_captures = input.type == manifest::input_type::source
-                                       ? matches[input.input_ix]
-                                       : rule_captured_paths[input.input_ix];
+      const auto &input_captures =
+          get_input_captures(input, i, matches, rule_captured_paths);
       for (const auto &input_capture : input_captures) {
-        auto local_output =
-            substitution::resolve(rule.output.segments, input_capture);
-        auto &datum = data_by_path[local_output.value];
-        datum.first.push_back(input_capture.value);
-        datum.second = local_output.segment_start_ids;
+        std::vector<substitution::resolved> outputs;
+        for (const auto &output : rule.outputs) {
+          outputs.push_back(
+              substitution::resolve(output.segments, input_capture));
+        }
+        auto &datum = data_by_path[outputs[0].value];
+        if (datum.local_input_paths.empty()) {
+          datum.outputs = std::move(outputs);
+        } else if (!have_same_values(datum.outputs, outputs)) {
+          throw inconsistent_rule_outputs_error{outputs[0].value, i};
+        }
+        datum.local_input_paths.push_back(input_capture.value);
       }
     }
     std::vector<std::vector<std::string>> dependency_groups =
         group_dependencies(rule.dependencies, i, matches, rule_captured_paths);
     std::vector<std::string> order_only_dependencies = flatten_dependencies(
         rule.order_only_dependencies, i, matches, rule_captured_paths);
+    for (const auto &dyndep_file : rule.dyndep_files) {
+      if (dyndep_file.type == manifest::input_type::source) {
+        throw source_dyndep_file_error{i};
+      }
+    }
+    std::vector<std::string> dyndep_file_paths = flatten_dependencies(
+        rule.dyndep_files, i, matches, rule_captured_paths);
+    result.dyndep_file_paths.insert(dyndep_file_paths.begin(),
+                                    dyndep_file_paths.end());
     auto &captured_paths = rule_captured_paths[i];
-    captured_paths.resize(data_by_path.size());
-    size_t k = 0;
+    captured_paths.resize(rule.outputs.size());
     for (const auto &datum : data_by_path) {
-      if (result.output_files_by_path.count(datum.first)) {
-        throw duplicate_output_error{
-            datum.first,
-            {rule_ids_by_output_path.at(datum.first), i},
-        };
+      std::vector<std::string> local_output_paths;
+      for (const auto &output : datum.second.outputs) {
+        local_output_paths.push_back(output.value);
+      }
+      for (size_t j = 0; j < rule.outputs.size(); ++j) {
+        const auto &output = datum.second.outputs[j];
+        if (result.output_files_by_path.count(output.value)) {
+          throw duplicate_output_error{
+              output.value,
+              {rule_ids_by_output_path.at(output.value), i},
+          };
+        }
+        result.output_files_by_path[output.value] = {
+            rule.command_line_ix,
+            datum.second.local_input_paths,
+            dependency_groups,
+            {order_only_dependencies.begin(), order_only_dependencies.end()},
+            {dyndep_file_paths.begin(), dyndep_file_paths.end()},
+            i,
+            rule.batch_size,
+            local_output_paths};
+        rule_ids_by_output_path[output.value] = i;
+        captured_paths[j].push_back(
+            substitution::capture(rule.outputs[j].capture_groups, output.value,
+                                  output.segment_start_ids));
       }
-      result.output_files_by_path[datum.first] = {
-          rule.command_line_ix,
-          datum.second.first,
-          dependency_groups,
-          {order_only_dependencies.begin(), order_only_dependencies.end()}};
-      rule_ids_by_output_path[datum.first] = i;
-      captured_paths[k] = substitution::capture(
-          rule.output.capture_groups, datum.first, datum.second.second);
-      ++k;
     }
   }
   return result;
@@ -18,6 +18,56 @@ struct duplicate_output_error {
   std::pair<size_t, size_t> rule_ids;
 };
 
+/**
+ * Thrown when a rule has no output pattern at all.
+ */
+struct missing_rule_output_error {
+  size_t rule_ix;
+};
+
+/**
+ * Thrown when a rule takes the files of an output of another rule that
+ * doesn't have that many outputs.
+ */
+struct unknown_rule_output_error {
+  size_t rule_ix;
+  size_t input_rule_ix;
+  size_t output_ix;
+};
+
+/**
+ * Thrown when inputs of a rule that resolve to the same first output resolve
+ * to different other outputs, as a single command would have to update all of
+ * these.
+ */
+struct inconsistent_rule_outputs_error {
+  std::string local_output_file_path;
+  size_t rule_ix;
+};
+
+/**
+ * Thrown when a dyndep file of a rule is a source file. Dyndep files are only
+ * read once they are updated, so they must be generated by another rule.
+ */
+struct source_dyndep_file_error {
+  size_t rule_ix;
+};
+
+/**
+ * Thrown when a command line template refers to a pool that doesn't exist.
+ */
+struct unknown_pool_error {
+  size_t command_line_ix;
+  size_t pool_ix;
+};
+
+/**
+ * Thrown when a pool doesn't allow any update to run.
+ */
+struct empty_pool_error {
+  size_t pool_ix;
+};
+
 update_map gen_update_map(const std::string &root_path,
                           const manifest::manifest &manifest);
 
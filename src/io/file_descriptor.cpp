@@ -12,6 +12,8 @@ file_descriptor::file_descriptor(file_descriptor &&other) : fd_(other.fd_) {
 }
 
 file_descriptor &file_descriptor::operator=(file_descriptor &&other) {
+  if (&other == this) return *this;
+  close();
   fd_ = other.fd_;
   other.fd_ = -1;
   return *this;
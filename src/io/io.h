@@ -5,6 +5,7 @@
 #include <functional>
 #include <iostream>
 #include <spawn.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <vector>
@@ -69,9 +70,26 @@ ssize_t read(int fd, void *buf, size_t count);
 
 void close(int fd);
 
+/**
+ * Flush the content of a file to the storage device, but not necessarily its
+ * metadata (except for the size), that is faster than `fsync`.
+ */
+void fdatasync(int fd);
+
+void ftruncate(int fd, off_t length);
+
 int rename(const char *old_path, const char *new_path) noexcept;
 
 int lstat(const char *path, struct ::stat *buf) noexcept;
+int stat(const char *path, struct ::stat *buf) noexcept;
+int fstat(int fd, struct ::stat *buf) noexcept;
+
+/**
+ * Map a file in memory. The returned pointer is always valid.
+ */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           off_t offset);
+void munmap(void *addr, size_t length);
 
 int unlink(const char *pathname) noexcept;
 
@@ -82,6 +100,13 @@ std::string ptsname(int fd);
 
 void pipe(int pipefd[2]);
 
+/**
+ * Like `pipe`, but both ends get closed when a process we start executes its
+ * program, so that it doesn't keep them open. This isn't atomic on systems
+ * without `pipe2`, where another thread could start a process in between.
+ */
+void pipe_cloexec(int pipefd[2]);
+
 int isatty(int fd);
 
 void posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *actions,
@@ -101,6 +126,38 @@ void posix_spawn(pid_t *pid, const char *path,
 
 pid_t waitpid(pid_t pid, int *status, int options);
 
+/**
+ * Wait for a child process to terminate, without reaping it, so that its pid
+ * doesn't get reused until `waitpid` gets called. That is `waitid` with
+ * `WNOWAIT`.
+ */
+void wait_exited(pid_t pid);
+
+/**
+ * Send a signal to a process, or to a process group if `pid` is negative.
+ */
+int kill(pid_t pid, int sig) noexcept;
+
+/**
+ * Get a file descriptor that becomes readable once the process exits. This is
+ * only available on Linux 5.3 and later, and throws `ENOSYS` otherwise.
+ */
+int pidfd_open(pid_t pid);
+
+/**
+ * Wait for many file descriptors at once, using `epoll` on Linux. Each file
+ * descriptor is registered for reading along with some `data` that identifies
+ * it; `epoll_wait` fills `data` with the ones of the file descriptors that are
+ * ready, either because they can be read, or because they were closed by the
+ * other end. It returns how many are ready, that may be zero if a signal
+ * interrupted the wait. `epoll_create` throws `ENOSYS` on other systems.
+ */
+int epoll_create();
+void epoll_add(int epfd, int fd, unsigned long long data);
+void epoll_remove(int epfd, int fd);
+size_t epoll_wait(int epfd, unsigned long long *data, size_t max_count,
+                  int timeout_ms);
+
 namespace mock {
 
 typedef std::vector<spawn_record> spawn_records_t;
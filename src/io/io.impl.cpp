@@ -4,6 +4,7 @@
 #include <cstring>
 #include <fcntl.h>
 #include <libgen.h>
+#include <signal.h>
 #include <stdexcept>
 #include <stdlib.h>
 #include <sys/param.h>
@@ -12,6 +13,11 @@
 #include <unistd.h>
 #include <vector>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
 namespace upd {
 namespace io {
 
@@ -23,7 +29,7 @@ std::string getcwd() {
 
 bool is_regular_file(const std::string &path) {
   struct stat data;
-  auto stat_ret = stat(path.c_str(), &data);
+  auto stat_ret = ::stat(path.c_str(), &data);
   if (stat_ret != 0) {
     if (errno == ENOENT) {
       return false;
@@ -83,6 +89,36 @@ int lstat(const char *path, struct ::stat *buf) noexcept {
   return ::lstat(path, buf);
 }
 
+int stat(const char *path, struct ::stat *buf) noexcept {
+  return ::stat(path, buf);
+}
+
+int fstat(int fd, struct ::stat *buf) noexcept { return ::fstat(fd, buf); }
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  void *result = ::mmap(addr, length, prot, flags, fd, offset);
+  if (result == MAP_FAILED) throw_errno();
+  return result;
+}
+
+void munmap(void *addr, size_t length) {
+  if (::munmap(addr, length) != 0) throw_errno();
+}
+
+void fdatasync(int fd) {
+#ifdef __APPLE__
+  // macOS doesn't have `fdatasync`.
+  if (::fsync(fd) != 0) throw_errno();
+#else
+  if (::fdatasync(fd) != 0) throw_errno();
+#endif
+}
+
+void ftruncate(int fd, off_t length) {
+  if (::ftruncate(fd, length) != 0) throw_errno();
+}
+
 int unlink(const char *pathname) noexcept { return ::unlink(pathname); }
 
 int posix_openpt(int oflag) {
@@ -109,6 +145,17 @@ void pipe(int pipefd[2]) {
   if (::pipe(pipefd) != 0) throw_errno();
 }
 
+void pipe_cloexec(int pipefd[2]) {
+#ifdef __linux__
+  if (::pipe2(pipefd, O_CLOEXEC) != 0) throw_errno();
+#else
+  if (::pipe(pipefd) != 0) throw_errno();
+  for (int i = 0; i < 2; ++i) {
+    if (::fcntl(pipefd[i], F_SETFD, FD_CLOEXEC) != 0) throw_errno();
+  }
+#endif
+}
+
 int isatty(int fd) { return ::isatty(fd); }
 
 void posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *actions,
@@ -152,5 +199,77 @@ pid_t waitpid(pid_t pid, int *status, int options) {
   return rpid;
 }
 
+void wait_exited(pid_t pid) {
+  siginfo_t info;
+  if (::waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0) throw_errno();
+}
+
+int kill(pid_t pid, int sig) noexcept { return ::kill(pid, sig); }
+
+int pidfd_open(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  int fd = static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+  if (fd < 0) throw_errno();
+  return fd;
+#else
+  throw std::system_error(ENOSYS, std::generic_category());
+#endif
+}
+
+#ifdef __linux__
+
+int epoll_create() {
+  int fd = ::epoll_create1(EPOLL_CLOEXEC);
+  if (fd < 0) throw_errno();
+  return fd;
+}
+
+void epoll_add(int epfd, int fd, unsigned long long data) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = data;
+  if (::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0) throw_errno();
+}
+
+void epoll_remove(int epfd, int fd) {
+  if (::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr) != 0) throw_errno();
+}
+
+size_t epoll_wait(int epfd, unsigned long long *data, size_t max_count,
+                  int timeout_ms) {
+  struct epoll_event events[64];
+  if (max_count > 64) max_count = 64;
+  int count = ::epoll_wait(epfd, events, static_cast<int>(max_count),
+                           timeout_ms);
+  if (count < 0) {
+    if (errno == EINTR) return 0;
+    throw_errno();
+  }
+  for (int i = 0; i < count; ++i) {
+    data[i] = events[i].data.u64;
+  }
+  return count;
+}
+
+#else
+
+int epoll_create() {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
+void epoll_add(int, int, unsigned long long) {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
+void epoll_remove(int, int) {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
+size_t epoll_wait(int, unsigned long long *, size_t, int) {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
+#endif
+
 } // namespace io
 } // namespace upd
@@ -1,5 +1,6 @@
 #include "io.h"
 #include "utils.h"
+#include <algorithm>
 #include <condition_variable>
 #include <cstring>
 #include <fcntl.h>
@@ -53,7 +54,7 @@ char *mkdtemp(char *tpl) noexcept {
       }
     }
     retval = io::mkdir(tpl, 0700);
-  } while (retval == 0 && errno == EEXIST);
+  } while (retval != 0 && errno == EEXIST);
   if (retval != 0) return nullptr;
   return tpl;
 }
@@ -85,6 +86,7 @@ struct file_node {
   std::shared_ptr<real_fd> pts_real_pipe_fd;
   size_t readers_count;
   size_t writers_count;
+  unsigned long long mtime_ns;
 };
 
 std::shared_ptr<file_node> root_dir(new file_node{
@@ -94,11 +96,18 @@ std::shared_ptr<file_node> root_dir(new file_node{
     nullptr,
     0,
     0,
+    0,
 });
 
 std::mutex gm;
 std::condition_variable fifo_cv;
 
+/**
+ * Files don't have a real modification time, instead each write gets a
+ * distinct, increasing timestamp so that changes are always observable.
+ */
+unsigned long long mtime_clock = 0;
+
 enum class fd_type {
   file,
   pipe,
@@ -111,6 +120,7 @@ struct fd_data {
   std::shared_ptr<real_fd> real_pipe_fd;
   bool readable;
   bool writable;
+  bool append;
 };
 
 typedef std::unordered_map<size_t, fd_data> fds_t;
@@ -214,7 +224,7 @@ int mkdir(const char *path, mode_t) noexcept {
   if (resolve(rs, path)) return -1;
   if (rs.node != nullptr) return set_errno(EEXIST);
   rs.node_path.back()->ents.emplace(
-      rs.name, new file_node{node_type::directory, {}, {}, nullptr, 0, 0});
+      rs.name, new file_node{node_type::directory, {}, {}, nullptr, 0, 0, 0});
   return 0;
 }
 
@@ -230,21 +240,46 @@ int rmdir(const char *path) noexcept {
   return 0;
 }
 
+/**
+ * While a registered binary runs, the file descriptors of its process, so that
+ * it can open them as "/dev/fd/N".
+ */
+static thread_local fds_t *spawned_fds = nullptr;
+static const std::string DEV_FD_PATH = "/dev/fd/";
+
 int open(const std::string &file_path, int flags, mode_t) {
   std::unique_lock<std::mutex> lock(gm);
+  if (spawned_fds != nullptr &&
+      file_path.compare(0, DEV_FD_PATH.size(), DEV_FD_PATH) == 0) {
+    auto spawned_fd = std::stoi(file_path.substr(DEV_FD_PATH.size()));
+    auto iter = spawned_fds->find(spawned_fd);
+    if (iter == spawned_fds->end()) throw_errno(ENOENT);
+    auto fd = alloc_fd();
+    fds[fd] = iter->second;
+    return fd;
+  }
   resolution_t rs;
   if (resolve(rs, file_path)) throw_errno();
   auto node = rs.node;
   if (node == nullptr) {
     if ((flags & O_CREAT) == 0) throw_errno(ENOENT);
     auto result = rs.node_path.back()->ents.emplace(
-        rs.name, new file_node{node_type::regular, {}, {}, nullptr, 0, 0});
+        rs.name, new file_node{node_type::regular, {}, {}, nullptr, 0, 0, 0});
     node = result.first->second;
   } else if (node->type == node_type::pts) {
+    if (node->pts_real_pipe_fd == nullptr) {
+      // The previous slave was closed, so the master has reached the end of
+      // the former pipe. Start a new one, like a pseudo-terminal that gets
+      // reopened.
+      std::array<int, 2> real_pipe_fds;
+      if (::pipe(real_pipe_fds.data()) != 0) throw_errno(errno);
+      fds[std::stoi(rs.name)].real_pipe_fd =
+          std::make_shared<real_fd>(real_pipe_fds[0]);
+      node->pts_real_pipe_fd = std::make_shared<real_fd>(real_pipe_fds[1]);
+    }
     auto fd = alloc_fd();
-    fds[fd] = {fd_type::pipe, node, 0, node->pts_real_pipe_fd, true, true};
-    // FIXME: this prevent reusing the same ptsname() twice, that does not
-    // fit the way it really works.
+    fds[fd] = {fd_type::pipe, node, 0, node->pts_real_pipe_fd, true, true,
+               false};
     node->pts_real_pipe_fd.reset();
     return fd;
   }
@@ -262,13 +297,19 @@ int open(const std::string &file_path, int flags, mode_t) {
       while (node->writers_count == 0 && node->buf.empty()) fifo_cv.wait(lock);
     }
   }
+  bool writable = (flags & O_WRONLY) > 0 || (flags & O_RDWR) > 0;
+  if (node->type == node_type::regular && writable && (flags & O_TRUNC) > 0) {
+    node->buf.clear();
+    node->mtime_ns = ++mtime_clock;
+  }
   auto fd = alloc_fd();
   fds[fd] = {fd_type::file,
              node,
              0,
              nullptr,
              (flags & O_WRONLY) == 0,
-             (flags & O_WRONLY) > 0 || (flags & O_RDWR) > 0};
+             writable,
+             (flags & O_APPEND) > 0};
   return fd;
 }
 
@@ -277,7 +318,7 @@ int mkfifo(const char *path, mode_t) noexcept {
   if (resolve(rs, path)) return -1;
   if (rs.node != nullptr) return set_errno(EEXIST);
   rs.node_path.back()->ents.emplace(
-      rs.name, new file_node{node_type::fifo, {}, {}, nullptr, 0, 0});
+      rs.name, new file_node{node_type::fifo, {}, {}, nullptr, 0, 0, 0});
   return 0;
 }
 
@@ -300,6 +341,8 @@ size_t write(fd_data &desc, const void *buf, size_t size) {
       fifo_cv.wait(lock);
     }
     desc.position = file_buf.size();
+  } else if (desc.append) {
+    desc.position = file_buf.size();
   }
   auto new_size = desc.position + size;
   if (file_buf.size() < new_size) {
@@ -307,6 +350,7 @@ size_t write(fd_data &desc, const void *buf, size_t size) {
   }
   std::memcpy(file_buf.data() + desc.position, buf, size);
   desc.position += size;
+  desc.node->mtime_ns = ++mtime_clock;
   if (desc.node->type == node_type::fifo) {
     lock.unlock();
     fifo_cv.notify_all();
@@ -315,7 +359,12 @@ size_t write(fd_data &desc, const void *buf, size_t size) {
 }
 
 size_t write(int fd, const void *buf, size_t size) {
-  return write(fds.at(fd), buf, size);
+  fd_data *desc;
+  {
+    std::unique_lock<std::mutex> lock(gm);
+    desc = &fds.at(fd);
+  }
+  return write(*desc, buf, size);
 }
 
 ssize_t read(int fd, void *buf, size_t size) {
@@ -363,6 +412,25 @@ void close(int fd) {
   fds.erase(fd);
 }
 
+void fdatasync(int fd) {
+  std::unique_lock<std::mutex> lock(gm);
+  auto iter = fds.find(fd);
+  if (iter == fds.end()) throw_errno(EBADF);
+  if (iter->second.type != fd_type::file) throw_errno(EINVAL);
+}
+
+void ftruncate(int fd, off_t length) {
+  std::unique_lock<std::mutex> lock(gm);
+  auto iter = fds.find(fd);
+  if (iter == fds.end()) throw_errno(EBADF);
+  auto &desc = iter->second;
+  if (desc.type != fd_type::file || desc.node->type != node_type::regular)
+    throw_errno(EINVAL);
+  if (!desc.writable) throw_errno(EBADF);
+  desc.node->buf.resize(length);
+  desc.node->mtime_ns = ++mtime_clock;
+}
+
 int rename(const char *old_path, const char *new_path) noexcept {
   std::unique_lock<std::mutex> lock(gm);
   resolution_t old_rs, new_rs;
@@ -378,27 +446,83 @@ int rename(const char *old_path, const char *new_path) noexcept {
   return 0;
 }
 
-int lstat(const char *path, struct ::stat *buf) noexcept {
-  std::unique_lock<std::mutex> lock(gm);
-  resolution_t rs;
-  if (resolve(rs, path)) return -1;
-  if (rs.node == nullptr) return set_errno(ENOENT);
+static void fill_stat(const file_node &node, struct ::stat *buf) {
   buf->st_dev = 999;
   buf->st_ino = 777;
   buf->st_mode = 0666;
-  if (rs.node->type == node_type::regular)
+  if (node.type == node_type::regular)
     buf->st_mode |= S_IFREG;
-  else if (rs.node->type == node_type::directory)
+  else if (node.type == node_type::directory)
     buf->st_mode |= S_IFDIR;
-  else if (rs.node->type == node_type::pts)
+  else if (node.type == node_type::pts)
     buf->st_mode |= S_IFIFO;
   buf->st_nlink = 1;
   buf->st_uid = 1;
   buf->st_gid = 2;
-  buf->st_size = rs.node->buf.size();
+  buf->st_size = node.buf.size();
+#ifdef __APPLE__
+  buf->st_mtimespec.tv_sec = node.mtime_ns / 1000000000;
+  buf->st_mtimespec.tv_nsec = node.mtime_ns % 1000000000;
+  buf->st_ctimespec = buf->st_mtimespec;
+#else
+  buf->st_mtim.tv_sec = node.mtime_ns / 1000000000;
+  buf->st_mtim.tv_nsec = node.mtime_ns % 1000000000;
+  buf->st_ctim = buf->st_mtim;
+#endif
+}
+
+int lstat(const char *path, struct ::stat *buf) noexcept {
+  std::unique_lock<std::mutex> lock(gm);
+  resolution_t rs;
+  if (resolve(rs, path)) return -1;
+  if (rs.node == nullptr) return set_errno(ENOENT);
+  fill_stat(*rs.node, buf);
   return 0;
 }
 
+int stat(const char *path, struct ::stat *buf) noexcept {
+  return io::lstat(path, buf);
+}
+
+int fstat(int fd, struct ::stat *buf) noexcept {
+  std::unique_lock<std::mutex> lock(gm);
+  auto iter = fds.find(fd);
+  if (iter == fds.end()) return set_errno(EBADF);
+  if (iter->second.node == nullptr) return set_errno(EINVAL);
+  fill_stat(*iter->second.node, buf);
+  return 0;
+}
+
+/**
+ * Mappings are private copies of the file content at the time of the call,
+ * that is enough for read-only uses.
+ */
+std::unordered_map<void *, std::unique_ptr<char[]>> mappings;
+
+void *mmap(void *, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  std::unique_lock<std::mutex> lock(gm);
+  if (length == 0 || (prot & PROT_WRITE) != 0 || (flags & MAP_SHARED) != 0)
+    throw_errno(EINVAL);
+  auto iter = fds.find(fd);
+  if (iter == fds.end()) throw_errno(EBADF);
+  auto &node = iter->second.node;
+  if (node == nullptr || node->type != node_type::regular) throw_errno(EACCES);
+  std::unique_ptr<char[]> data(new char[length]());
+  if (static_cast<size_t>(offset) < node->buf.size()) {
+    auto size = std::min(length, node->buf.size() - offset);
+    std::memcpy(data.get(), node->buf.data() + offset, size);
+  }
+  void *addr = data.get();
+  mappings.emplace(addr, std::move(data));
+  return addr;
+}
+
+void munmap(void *addr, size_t) {
+  std::unique_lock<std::mutex> lock(gm);
+  if (mappings.erase(addr) == 0) throw_errno(EINVAL);
+}
+
 int unlink(const char *ent_path) noexcept {
   resolution_t rs;
   if (resolve(rs, ent_path)) return -1;
@@ -414,9 +538,9 @@ int posix_openpt(int) {
   std::array<int, 2> real_pipe_fds;
   if (::pipe(real_pipe_fds.data()) != 0) throw_errno(errno);
   auto master_pt_fd = alloc_fd();
-  fds[master_pt_fd] = {
-      fd_type::pipe, nullptr, 0, std::make_shared<real_fd>(real_pipe_fds[0]),
-      true,          true};
+  fds[master_pt_fd] = {fd_type::pipe, nullptr, 0,
+                       std::make_shared<real_fd>(real_pipe_fds[0]), true, true,
+                       false};
   try {
     mkdir("/pseudoterminal", 0);
   } catch (std::system_error error) {
@@ -431,6 +555,7 @@ int posix_openpt(int) {
                              {},
                              std::make_shared<real_fd>(real_pipe_fds[1]),
                              0,
+                             0,
                              0});
   return master_pt_fd;
 }
@@ -443,17 +568,24 @@ std::string ptsname(int fd) { return "/pseudoterminal/" + std::to_string(fd); }
 void pipe(int pipefd[2]) {
   std::array<int, 2> real_pipe_fds;
   if (::pipe(real_pipe_fds.data()) != 0) throw_errno(errno);
+  std::lock_guard<std::mutex> lock(gm);
   auto read_fd = pipefd[0] = alloc_fd();
-  fds[read_fd] = {
-      fd_type::pipe, nullptr, 0, std::make_shared<real_fd>(real_pipe_fds[0]),
-      true,          false};
+  fds[read_fd] = {fd_type::pipe, nullptr, 0,
+                  std::make_shared<real_fd>(real_pipe_fds[0]), true, false,
+                  false};
   auto write_fd = pipefd[1] = alloc_fd();
-  fds[write_fd] = {
-      fd_type::pipe, nullptr, 0, std::make_shared<real_fd>(real_pipe_fds[1]),
-      false,         true};
+  fds[write_fd] = {fd_type::pipe, nullptr, 0,
+                   std::make_shared<real_fd>(real_pipe_fds[1]), false, true,
+                   false};
 }
 
+/**
+ * Processes of the mock don't execute anything, so that is the same.
+ */
+void pipe_cloexec(int pipefd[2]) { pipe(pipefd); }
+
 int isatty(int fd) {
+  std::lock_guard<std::mutex> lock(gm);
   auto &desc = fds[fd];
   return desc.node->type == node_type::pts;
 }
@@ -476,6 +608,7 @@ std::unordered_map<const posix_spawn_file_actions_t *,
 
 void posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *actions,
                                        int fd) {
+  std::lock_guard<std::mutex> lock(gm);
   auto actions_iter = file_action_entries.find(actions);
   if (actions_iter == file_action_entries.end()) throw_errno(EINVAL);
   actions_iter->second.acts.push_back({action_type::close, fd, -1});
@@ -483,6 +616,7 @@ void posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *actions,
 
 void posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *actions,
                                       int fd, int new_fd) {
+  std::lock_guard<std::mutex> lock(gm);
   auto actions_iter = file_action_entries.find(actions);
   if (actions_iter == file_action_entries.end()) throw_errno(EINVAL);
   actions_iter->second.acts.push_back({action_type::dup2, fd, new_fd});
@@ -490,17 +624,20 @@ void posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *actions,
 
 void posix_spawn_file_actions_addopen(posix_spawn_file_actions_t *actions, int,
                                       const char *, int, mode_t) {
+  std::lock_guard<std::mutex> lock(gm);
   if (file_action_entries.find(actions) == file_action_entries.end())
     throw_errno(EINVAL);
 }
 
 void posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *actions) {
+  std::lock_guard<std::mutex> lock(gm);
   if (file_action_entries.find(actions) == file_action_entries.end())
     throw_errno(EINVAL);
   file_action_entries.erase(actions);
 }
 
 void posix_spawn_file_actions_init(posix_spawn_file_actions_t *actions) {
+  std::lock_guard<std::mutex> lock(gm);
   if (file_action_entries.find(actions) != file_action_entries.end())
     throw_errno(EINVAL);
   file_action_entries[actions] = {};
@@ -532,6 +669,7 @@ void posix_spawn(pid_t *pid, const char *binary_path,
                  const posix_spawn_file_actions_t *file_actions,
                  const posix_spawnattr_t *, char *const args[],
                  char *const env[]) {
+  std::unique_lock<std::mutex> lock(gm);
   auto actions_iter = file_action_entries.find(file_actions);
   if (actions_iter == file_action_entries.end()) throw_errno(EINVAL);
   // FIXME: use resolve() instead.
@@ -555,8 +693,16 @@ void posix_spawn(pid_t *pid, const char *binary_path,
     }
     }
   }
+  lock.unlock();
   if (reg_bin->second.fn) {
-    reg_bin->second.fn(args);
+    spawned_fds = &proc_fds;
+    try {
+      reg_bin->second.fn(args);
+    } catch (...) {
+      spawned_fds = nullptr;
+      throw;
+    }
+    spawned_fds = nullptr;
   }
   auto const &stdout = reg_bin->second.stdout;
   write(proc_fds[STDOUT_FILENO], stdout.c_str(), stdout.size());
@@ -571,6 +717,33 @@ pid_t waitpid(pid_t pid, int *stat_loc, int) {
   return pid;
 }
 
+void wait_exited(pid_t) {}
+
+/**
+ * The pids of the mock aren't real, so signals must not reach any process.
+ */
+int kill(pid_t, int) noexcept { return 0; }
+
+/**
+ * Processes of the mock run synchronously, so there is nothing to wait for.
+ * Reporting these as unsupported makes the callers use the threads instead.
+ */
+int pidfd_open(pid_t) {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
+int epoll_create() {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
+void epoll_add(int, int, unsigned long long) { throw_errno(ENOSYS); }
+
+void epoll_remove(int, int) { throw_errno(ENOSYS); }
+
+size_t epoll_wait(int, unsigned long long *, size_t, int) {
+  throw std::system_error(ENOSYS, std::generic_category());
+}
+
 namespace mock {
 
 void reset() {
@@ -581,6 +754,7 @@ void reset() {
       nullptr,
       0,
       0,
+      0,
   });
   fds.clear();
   file_action_entries.clear();
@@ -1,5 +1,6 @@
 #include "utils.h"
 #include "file_descriptor.h"
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <fcntl.h>
@@ -21,6 +22,29 @@ std::string mkdtemp_s(const std::string &template_path) {
   return tpl.data();
 }
 
+static unsigned long long get_timespec_ns(const struct timespec &value) {
+  return static_cast<unsigned long long>(value.tv_sec) * 1000000000 +
+         value.tv_nsec;
+}
+
+#ifdef __APPLE__
+unsigned long long get_mtime_ns(const struct ::stat &data) {
+  return get_timespec_ns(data.st_mtimespec);
+}
+
+unsigned long long get_ctime_ns(const struct ::stat &data) {
+  return get_timespec_ns(data.st_ctimespec);
+}
+#else
+unsigned long long get_mtime_ns(const struct ::stat &data) {
+  return get_timespec_ns(data.st_mtim);
+}
+
+unsigned long long get_ctime_ns(const struct ::stat &data) {
+  return get_timespec_ns(data.st_ctim);
+}
+#endif
+
 constexpr size_t BLOCK_SIZE = 1 << 12;
 
 std::string read_entire_file(const std::string &file_path) {
@@ -37,13 +61,29 @@ std::string read_entire_file(const std::string &file_path) {
 
 void write_entire_file(const std::string &file_path,
                        const std::string &content) {
-  file_descriptor fd = io::open(file_path, O_WRONLY | O_CREAT, S_IRWXU);
-  for (size_t i = 0; i < file_path.size(); i += BLOCK_SIZE) {
-    auto slice = content.substr(i, BLOCK_SIZE);
-    io::write(fd, slice.c_str(), slice.size());
+  file_descriptor fd =
+      io::open(file_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+  size_t offset = 0;
+  while (offset < content.size()) {
+    offset += io::write(fd, content.data() + offset,
+                        std::min(BLOCK_SIZE, content.size() - offset));
   }
 }
 
+mapped_file::mapped_file(int fd) : data_(nullptr), size_(0) {
+  struct ::stat data;
+  if (io::fstat(fd, &data) != 0) throw_errno();
+  size_ = data.st_size;
+  // Empty mappings are not allowed.
+  if (size_ == 0) return;
+  data_ = static_cast<char *>(
+      io::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0));
+}
+
+mapped_file::~mapped_file() {
+  if (data_ != nullptr) io::munmap(data_, size_);
+}
+
 dir::dir(const std::string &path) : ptr_(io::opendir(path.c_str())) {
   if (ptr_ == nullptr) throw std::runtime_error("opendir() failed");
 }
@@ -19,10 +19,32 @@ void mkdir_s(const std::string &dir_path, mode_t mode);
  */
 std::string mkdtemp_s(const std::string &template_path);
 
+/**
+ * Modification and status change times of a file, in nanoseconds.
+ */
+unsigned long long get_mtime_ns(const struct ::stat &data);
+unsigned long long get_ctime_ns(const struct ::stat &data);
+
 std::string read_entire_file(const std::string &file_path);
 void write_entire_file(const std::string &file_path,
                        const std::string &content);
 
+/**
+ * Map the entire content of a file in memory, read-only. The mapping is
+ * released automatically.
+ */
+struct mapped_file {
+  mapped_file(int fd);
+  mapped_file(mapped_file &) = delete;
+  ~mapped_file();
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  char *data_;
+  size_t size_;
+};
+
 /**
  * Keep track and automatically delete a directory handle.
  */
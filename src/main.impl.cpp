@@ -6,7 +6,8 @@
 #include "manifest/read_from_file.h"
 #include "package.h"
 #include "path.h"
-#include "update_log/read.h"
+#include "tool_process.h"
+#include <csignal>
 #include <cstring>
 
 namespace upd {
@@ -127,14 +128,25 @@ int run_with_options(const cli::options &cli_opts, bool auto_color_diags) {
       std::cout << root_path << std::endl;
       return 0;
     }
+    if (cli_opts.command == cli::command::gc) {
+      collect_garbage(root_path);
+      return 0;
+    }
     execute_manifest(root_path, working_path,
                      cli_opts.command == cli::command::graph, cli_opts.all,
                      cli_opts.rest_args, cli_opts.print_commands,
                      cli_opts.command == cli::command::script,
-                     get_concurrency(cli_opts.concurrency));
+                     get_concurrency(cli_opts.concurrency),
+                     cli_opts.keep_going);
     return 0;
   } catch (const update_failed_error &error) {
     err() << "one or more files failed to update" << std::endl;
+  } catch (const update_cancelled_error &error) {
+    err() << "interrupted by signal " << error.signal << std::endl;
+    // Our parent, such as a shell, can then tell we got interrupted, and
+    // stop as well.
+    std::signal(error.signal, SIG_DFL);
+    std::raise(error.signal);
   } catch (const cannot_find_root_error &) {
     err() << "cannot find a `.updroot' file in the current directory or "
           << "in any of the parent directories" << std::endl
@@ -147,9 +159,6 @@ int run_with_options(const cli::options &cli_opts, bool auto_color_diags) {
           << std::endl;
   } catch (const io::ifstream_failed_error &error) {
     err() << "failed to read file `" << error.file_path << "`" << std::endl;
-  } catch (const update_log::unexpected_end_of_file_error &) {
-    err() << "update log is corrupted; delete or revert the `.upd/log' file"
-          << std::endl;
   } catch (const unknown_target_error &error) {
     err() << "unknown output file: " << error.relative_path << std::endl;
   } catch (const relative_path_out_of_root_error &error) {
@@ -165,12 +174,29 @@ int run_with_options(const cli::options &cli_opts, bool auto_color_diags) {
           << "' is generated by the two conflicting rules #"
           << error.rule_ids.first << " and #" << error.rule_ids.second
           << std::endl;
-  } catch (const undeclared_rule_dependency_error &error) {
-    err() << "the output file `" << error.local_target_path
-          << "' was detected to depend on the generated file `"
-          << error.local_dependency_path << "'; it must be specified "
-          << "explicitly in the \"dependencies\" section of the rule"
+  } catch (const missing_rule_output_error &error) {
+    err() << "the rule #" << error.rule_ix << " has no output" << std::endl;
+  } catch (const unknown_rule_output_error &error) {
+    err() << "the rule #" << error.rule_ix << " refers to the output #"
+          << error.output_ix << " of the rule #" << error.input_rule_ix
+          << ", that doesn't exist" << std::endl;
+  } catch (const inconsistent_rule_outputs_error &error) {
+    err() << "the inputs of the rule #" << error.rule_ix
+          << " that update the output file `" << error.local_output_file_path
+          << "' don't all resolve to the same other outputs" << std::endl;
+  } catch (const source_dyndep_file_error &error) {
+    err() << "the rule #" << error.rule_ix << " has a source file as dyndep "
+          << "file; dyndep files must be generated by another rule"
           << std::endl;
+  } catch (const unknown_pool_error &error) {
+    err() << "the command line template #" << error.command_line_ix
+          << " refers to the pool #" << error.pool_ix
+          << ", that doesn't exist" << std::endl;
+  } catch (const empty_pool_error &error) {
+    err() << "the pool #" << error.pool_ix
+          << " must have a concurrency of at least 1" << std::endl;
+  } catch (const undeclared_rule_dependency_error &error) {
+    err() << error << std::endl;
   } catch (const manifest::invalid_manifest_error<json::invalid_character_error>
                &error) {
     es << error_header{working_path, error.file_path, error.reason.location,
@@ -214,10 +240,9 @@ int run_with_options(const cli::options &cli_opts, bool auto_color_diags) {
                        error.reason.location.from, color_diags}
        << " unexpected number" << std::endl;
   } catch (const file_changed_manually_error &error) {
-    err() << "the file `" << error.local_file_path << "' "
-          << "has been modified manually and won't "
-          << "be overwritten in order to protect local changes; "
-          << "to resolve this issue, revert the file or delete it" << std::endl;
+    err() << error << std::endl;
+  } catch (const invalid_tool_response_error &error) {
+    err() << error << std::endl;
   }
   return 2;
 }
@@ -246,10 +271,19 @@ int run(int argc, char *argv[]) {
     err() << "`" << error.value
           << "` is not a valid concurrency; specify `auto`, "
           << "or a number greater than zero" << std::endl;
+  } catch (cli::invalid_keep_going_error error) {
+    err() << "`" << error.value
+          << "` is not a valid number of failures; specify a number, or "
+          << "zero for no limit" << std::endl;
   }
   return 1;
 }
 
 } // namespace upd
 
-int main(int argc, char *argv[]) { return upd::run(argc, argv); }
+int main(int argc, char *argv[]) {
+  // Writing a request to a persistent worker that terminated must fail with
+  // `EPIPE` rather than terminate us (see "tool_process.h").
+  std::signal(SIGPIPE, SIG_IGN);
+  return upd::run(argc, argv);
+}
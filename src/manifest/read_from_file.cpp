@@ -55,7 +55,7 @@ struct object_handler
     : public json::all_unexpected_elements_handler<ReturnValue> {
   template <typename ObjectReader>
   ReturnValue object(ObjectReader &reader) const {
-    ReturnValue value;
+    ReturnValue value{};
     std::string field_name;
     while (reader.next(field_name)) {
       FieldReader<ObjectReader &>::read(reader, field_name, value);
@@ -77,6 +77,10 @@ template <typename ObjectReader> struct read_rule_input_field {
       value.type = input_type::rule;
       return;
     }
+    if (field_name == "output_ix") {
+      value.output_ix = reader.next_value(read_size_t_handler());
+      return;
+    }
     throw std::runtime_error("doesn't know field `" + field_name + "`");
   }
 };
@@ -89,7 +93,16 @@ template <typename ObjectReader> struct read_rule_field {
       return;
     }
     if (field_name == "output") {
-      value.output = reader.next_value(read_rule_output_handler());
+      value.outputs = {reader.next_value(read_rule_output_handler())};
+      return;
+    }
+    if (field_name == "outputs") {
+      json::read_vector_field_value<read_rule_output_handler>(reader,
+                                                              value.outputs);
+      return;
+    }
+    if (field_name == "batch_size") {
+      value.batch_size = reader.next_value(read_size_t_handler());
       return;
     }
     if (field_name == "inputs") {
@@ -110,6 +123,12 @@ template <typename ObjectReader> struct read_rule_field {
           reader, value.order_only_dependencies);
       return;
     }
+    if (field_name == "dyndep_files") {
+      json::read_vector_field_value<
+          object_handler<update_rule_input, read_rule_input_field>>(
+          reader, value.dyndep_files);
+      return;
+    }
     throw std::runtime_error("doesn't know field `" + field_name + "`");
   }
 };
@@ -151,6 +170,11 @@ template <typename ObjectReader> struct read_command_line_template_part_field {
           reader, value.variable_args);
       return;
     }
+    if (field_name == "response_file_prefix") {
+      value.response_file_prefix = reader.next_value(read_string_handler());
+      value.uses_response_file = true;
+      return;
+    }
     throw std::runtime_error("doesn't know field `" + field_name + "`");
   }
 };
@@ -185,6 +209,27 @@ template <typename ObjectReader> struct read_command_line_template_field {
       value.environment = reader.next_value(read_environment_handler());
       return;
     }
+    if (field_name == "worker_arguments") {
+      json::read_vector_field_value<string_handler>(reader, value.worker_args);
+      value.persistent_worker = true;
+      return;
+    }
+    if (field_name == "pool_ix") {
+      value.pool_ix = reader.next_value(read_size_t_handler());
+      value.has_pool = true;
+      return;
+    }
+    throw std::runtime_error("doesn't know field `" + field_name + "`");
+  }
+};
+
+template <typename ObjectReader> struct read_pool_field {
+  static void read(ObjectReader reader, const std::string &field_name,
+                   update_pool &value) {
+    if (field_name == "concurrency") {
+      value.concurrency = reader.next_value(read_size_t_handler());
+      return;
+    }
     throw std::runtime_error("doesn't know field `" + field_name + "`");
   }
 };
@@ -208,6 +253,11 @@ template <typename ObjectReader> struct read_manifest_field {
           reader, value.command_line_templates);
       return;
     }
+    if (field_name == "pools") {
+      json::read_vector_field_value<
+          object_handler<update_pool, read_pool_field>>(reader, value.pools);
+      return;
+    }
     throw std::runtime_error("doesn't know field `" + field_name + "`");
   }
 };
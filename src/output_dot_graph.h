@@ -20,10 +20,12 @@ void output_dot_graph(
     auto const &target_file = target_descriptor.second;
     auto const &command_line_tpl =
         command_line_templates[target_file.command_line_ix];
-    for (auto const &input_path : target_file.local_input_file_paths) {
-      os << "  \"" << input_path << "\" -> \"" << local_target_path
-         << "\" [label=\"" << command_line_tpl.binary_path << "\"];"
-         << std::endl;
+    for (auto const &output_path : target_file.local_output_paths) {
+      for (auto const &input_path : target_file.local_input_file_paths) {
+        os << "  \"" << input_path << "\" -> \"" << output_path
+           << "\" [label=\"" << command_line_tpl.binary_path << "\"];"
+           << std::endl;
+      }
     }
 
     plan.erase(local_target_path);
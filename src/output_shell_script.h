@@ -23,10 +23,12 @@ void output_shell_script(
     auto const &target_file = target_descriptor.second;
     auto const &command_line_tpl =
         command_line_templates[target_file.command_line_ix];
-    auto local_dir = dirname(local_target_path);
-    if (mked_dir_paths.count(local_dir) == 0) {
-      shell_escape(os << "mkdir -p ", local_dir) << std::endl;
-      mked_dir_paths.insert(local_dir);
+    for (auto const &local_output_path : target_file.local_output_paths) {
+      auto local_dir = dirname(local_output_path);
+      if (mked_dir_paths.count(local_dir) == 0) {
+        shell_escape(os << "mkdir -p ", local_dir) << std::endl;
+        mked_dir_paths.insert(local_dir);
+      }
     }
     auto command_line = reify_command_line(command_line_tpl,
                                            {"/dev/null",
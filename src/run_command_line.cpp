@@ -40,63 +40,106 @@ static std::string read_fd_to_string(int fd, bool allow_eio) {
   return result.str();
 }
 
-/**
- * `posix_spawn()` to run a command line.
- */
-command_line_result run_command_line(const command_line &target,
-                                     int stderr_read_fd,
-                                     const std::string &stderr_pts) {
+const char *const DEPFILE_PATH = "/dev/fd/3";
+
+pid_t spawn_command_line(const command_line &target,
+                         const command_line_fds &fds) {
   system::string_vector argv;
   argv.push_back(target.binary_path);
   for (auto const &arg : target.args) {
     argv.push_back(arg);
   }
 
-  int stdout[2];
-  io::pipe(stdout);
+  system::spawn_file_actions actions;
 
-  int stderr_fd = io::open(stderr_pts.c_str(), O_WRONLY | O_NOCTTY, 0);
-  if (!io::isatty(stderr_fd)) throw std::runtime_error("stderr is not a tty");
+  // The process is not in the foreground process group of the terminal, so
+  // reading from it would stop the process instead.
+  actions.add_open(STDIN_FILENO, "/dev/null", O_RDONLY);
+  actions.add_close(fds.stdout_read);
+  actions.add_dup2(fds.stdout_write, STDOUT_FILENO);
+  actions.add_close(fds.stdout_write);
+
+  actions.add_close(fds.stderr_read);
+  actions.add_dup2(fds.stderr_write, STDERR_FILENO);
+  actions.add_close(fds.stderr_write);
+
+  // Either end of the pipe may already be `DEPFILE_FD`, as it's the lowest
+  // number after the standard streams. Our descriptors are close-on-exec, and
+  // only `dup2` to another number clears that on the copy, so a write end that
+  // is already `DEPFILE_FD` goes through the number of the read end first.
+  if (fds.depfile_write == DEPFILE_FD) {
+    actions.add_dup2(fds.depfile_write, fds.depfile_read);
+    actions.add_dup2(fds.depfile_read, DEPFILE_FD);
+    actions.add_close(fds.depfile_read);
+  } else if (fds.depfile_write >= 0) {
+    if (fds.depfile_read != DEPFILE_FD) actions.add_close(fds.depfile_read);
+    actions.add_dup2(fds.depfile_write, DEPFILE_FD);
+    actions.add_close(fds.depfile_write);
+  }
 
-  system::spawn_file_actions actions;
+  system::string_vector env;
+  env.push_back("TERM=xterm-color");
+  for (const auto &var : target.environment) {
+    env.push_back(var.first + "=" + var.second);
+  }
 
-  actions.add_close(stdout[0]);
-  actions.add_dup2(stdout[1], STDOUT_FILENO);
-  actions.add_close(stdout[1]);
+  return system::spawn(target.binary_path, actions, argv, env);
+}
 
-  actions.add_close(stderr_read_fd);
-  actions.add_dup2(stderr_fd, STDERR_FILENO);
-  actions.add_close(stderr_fd);
+/**
+ * `posix_spawn()` to run a command line.
+ */
+command_line_result run_command_line(const command_line &target,
+                                     int stderr_read_fd,
+                                     const std::string &stderr_pts,
+                                     bool has_depfile) {
+  // Other workers spawn processes at the same time, that must not inherit
+  // these, or we would only see the end of the output once they exit too.
+  int stdout[2];
+  io::pipe_cloexec(stdout);
+  int depfile[2] = {-1, -1};
+  if (has_depfile) io::pipe_cloexec(depfile);
+
+  int stderr_fd =
+      io::open(stderr_pts.c_str(), O_WRONLY | O_NOCTTY | O_CLOEXEC, 0);
+  if (!io::isatty(stderr_fd)) throw std::runtime_error("stderr is not a tty");
 
   auto read_stdout =
       std::async(std::launch::async, &read_fd_to_string, stdout[0], false);
   auto read_stderr =
       std::async(std::launch::async, &read_fd_to_string, stderr_read_fd, true);
-
-  system::string_vector env;
-  env.push_back("TERM=xterm-color");
-  for (const auto &var : target.environment) {
-    env.push_back(var.first + "=" + var.second);
+  std::future<std::string> read_depfile;
+  if (has_depfile) {
+    read_depfile =
+        std::async(std::launch::async, &read_fd_to_string, depfile[0], false);
   }
 
-  pid_t child_pid = system::spawn(target.binary_path, actions, argv, env);
-  actions.destroy();
+  pid_t child_pid = spawn_command_line(
+      target, {stdout[0], stdout[1], stderr_read_fd, stderr_fd, depfile[0],
+               depfile[1]});
 
   io::close(stdout[1]);
   io::close(stderr_fd);
+  if (has_depfile) io::close(depfile[1]);
 
-  int status;
-  io::waitpid(child_pid, &status, 0);
-
-  command_line_result result = {
-      read_stdout.get(),
-      read_stderr.get(),
-      status,
-  };
+  // Other processes of its group may keep the output open after it exits,
+  // so we only reap the process once we read everything, so that its process
+  // group stays the same until that point.
+  command_line_result result;
+  result.stdout = read_stdout.get();
+  result.stderr = read_stderr.get();
+  if (has_depfile) result.depfile = read_depfile.get();
+  system::wait(child_pid, &result.status);
 
   io::close(stdout[0]);
+  if (has_depfile) io::close(depfile[0]);
 
   return result;
 }
 
+bool is_successful(const command_line_result &result) {
+  return result.stdout.empty() && WIFEXITED(result.status) != 0 &&
+         WEXITSTATUS(result.status) == 0;
+}
+
 } // namespace upd
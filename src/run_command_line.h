@@ -2,17 +2,61 @@
 
 #include "command_line_template.h"
 #include <string>
+#include <sys/types.h>
 
 namespace upd {
 
+/**
+ * Processes that write a depfile get it as that file descriptor, that they
+ * can open as `DEPFILE_PATH`. We read it as it gets written, like the output
+ * of the process, so that it doesn't need any file of its own.
+ */
+constexpr int DEPFILE_FD = 3;
+extern const char *const DEPFILE_PATH;
+
 struct command_line_result {
   std::string stdout;
   std::string stderr;
   int status;
+  /**
+   * What the process wrote to its depfile, if it was given one.
+   */
+  std::string depfile;
+};
+
+/**
+ * The pipes that a process writes to. The process gets the write ends as its
+ * stdout, stderr and depfile, while the read ends are closed in the process,
+ * but not in the caller. The depfile ones are -1 if there is no depfile.
+ */
+struct command_line_fds {
+  int stdout_read;
+  int stdout_write;
+  int stderr_read;
+  int stderr_write;
+  int depfile_read;
+  int depfile_write;
 };
 
+/**
+ * Start the process of a command line and return its pid.
+ */
+pid_t spawn_command_line(const command_line &target,
+                         const command_line_fds &fds);
+
+/**
+ * Run the process of a command line until it terminates, reading its output
+ * and, if `has_depfile` is `true`, its depfile.
+ */
 command_line_result run_command_line(const command_line &target,
                                      int stderr_read_fd,
-                                     const std::string &stderr_pts);
+                                     const std::string &stderr_pts,
+                                     bool has_depfile);
+
+/**
+ * A command succeeded if it exited normally with a zero exit code, and didn't
+ * produce any output on stdout.
+ */
+bool is_successful(const command_line_result &result);
 
 } // namespace upd
@@ -0,0 +1,39 @@
+#include "scratch_dir.h"
+#include "io/utils.h"
+
+namespace upd {
+
+scratch_dir::scratch_dir(const std::string &template_path)
+    : template_path_(template_path) {}
+
+scratch_dir::scratch_dir(scratch_dir &&other)
+    : template_path_(std::move(other.template_path_)),
+      path_(std::move(other.path_)),
+      file_paths_(std::move(other.file_paths_)) {
+  other.path_.clear();
+  other.file_paths_.clear();
+}
+
+/**
+ * Failing to clean up is not worth reporting, as the directory is only ever
+ * used by a single run.
+ */
+scratch_dir::~scratch_dir() {
+  if (path_.empty()) return;
+  for (auto const &file_path : file_paths_) {
+    io::unlink(file_path.c_str());
+  }
+  io::rmdir(path_.c_str());
+}
+
+std::string scratch_dir::write_file(const std::string &name_suffix,
+                                    const std::string &content) {
+  if (path_.empty()) path_ = io::mkdtemp_s(template_path_);
+  auto file_path =
+      path_ + '/' + std::to_string(file_paths_.size()) + name_suffix;
+  io::write_entire_file(file_path, content);
+  file_paths_.push_back(file_path);
+  return file_path;
+}
+
+} // namespace upd
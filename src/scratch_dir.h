@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace upd {
+
+/**
+ * A directory for the files that only matter while we run, such as response
+ * files. It is created on first use from `template_path`, that ends with
+ * "XXXXXX" (see `io::mkdtemp_s`), and it is removed with all these files once
+ * we are done.
+ */
+struct scratch_dir {
+  scratch_dir(const std::string &template_path);
+  scratch_dir(scratch_dir &) = delete;
+  scratch_dir(scratch_dir &&other);
+  ~scratch_dir();
+
+  /**
+   * Write a new file with that content, and return its full path.
+   */
+  std::string write_file(const std::string &name_suffix,
+                         const std::string &content);
+
+private:
+  std::string template_path_;
+  std::string path_;
+  std::vector<std::string> file_paths_;
+};
+
+} // namespace upd
@@ -3,6 +3,10 @@
 #include <cstring>
 #include <errno.h>
 #include <iostream>
+#include <mutex>
+#include <signal.h>
+#include <system_error>
+#include <unordered_set>
 
 namespace upd {
 namespace system {
@@ -26,6 +30,10 @@ void spawn_file_actions::add_dup2(int fd, int newfd) {
   io::posix_spawn_file_actions_adddup2(&pdfa_, fd, newfd);
 }
 
+void spawn_file_actions::add_open(int fd, const char *path, int oflag) {
+  io::posix_spawn_file_actions_addopen(&pdfa_, fd, path, oflag, 0);
+}
+
 void spawn_file_actions::destroy() {
   if (!init_) return;
   init_ = false;
@@ -49,14 +57,66 @@ void string_vector::push_back(const std::string &value) {
 
 char **string_vector::data() { return v_.data(); }
 
+/**
+ * We ignore `SIGPIPE` ourselves, but the processes we start would inherit
+ * that, so they get the default action back. A process group ID of zero
+ * means the one of the new process is its own pid.
+ */
+struct spawn_attributes {
+  spawn_attributes() {
+    check(::posix_spawnattr_init(&attr));
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    check(::posix_spawnattr_setsigdefault(&attr, &default_signals));
+    check(::posix_spawnattr_setpgroup(&attr, 0));
+    check(::posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                                                POSIX_SPAWN_SETPGROUP));
+  }
+  ~spawn_attributes() { ::posix_spawnattr_destroy(&attr); }
+  spawn_attributes(spawn_attributes &) = delete;
+
+  static void check(int error) {
+    if (error != 0) throw std::system_error(error, std::generic_category());
+  }
+
+  posix_spawnattr_t attr;
+};
+
+/**
+ * The processes we started and didn't reap yet. As these are the leaders of
+ * their process group, the group cannot go away before they get reaped.
+ */
+static std::mutex live_pids_mutex;
+static std::unordered_set<pid_t> live_pids;
+
 int spawn(const std::string binary_path, const spawn_file_actions &actions,
           string_vector &argv, string_vector &env) {
   pid_t pid;
   auto bin = binary_path.c_str();
   auto pa = &actions.posix();
-  io::posix_spawn(&pid, bin, pa, nullptr, argv.data(), env.data());
+  spawn_attributes attrs;
+  io::posix_spawn(&pid, bin, pa, &attrs.attr, argv.data(), env.data());
+  std::lock_guard<std::mutex> lock(live_pids_mutex);
+  live_pids.insert(pid);
   return pid;
 }
 
+void wait(pid_t pid, int *status) {
+  io::wait_exited(pid);
+  {
+    std::lock_guard<std::mutex> lock(live_pids_mutex);
+    live_pids.erase(pid);
+  }
+  io::waitpid(pid, status, 0);
+}
+
+void kill_all(int sig) {
+  std::lock_guard<std::mutex> lock(live_pids_mutex);
+  for (auto pid : live_pids) {
+    io::kill(-pid, sig);
+  }
+}
+
 } // namespace system
 } // namespace upd
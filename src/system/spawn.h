@@ -2,6 +2,7 @@
 
 #include <spawn.h>
 #include <string>
+#include <sys/types.h>
 #include <vector>
 
 namespace upd {
@@ -19,6 +20,7 @@ struct spawn_file_actions {
 
   void add_close(int fd);
   void add_dup2(int fd, int newfd);
+  void add_open(int fd, const char *path, int oflag);
   void destroy();
   const posix_spawn_file_actions_t &posix() const { return pdfa_; }
 
@@ -45,10 +47,26 @@ private:
 };
 
 /**
- * Wrapper around `posix_spawn` that throws in case of error.
+ * Wrapper around `posix_spawn` that throws in case of error. Each process
+ * gets its own process group, so that it doesn't get the signals meant for us,
+ * such as the one of Ctrl-C in a terminal. We forward these with `kill_all`
+ * instead.
  */
 int spawn(const std::string binary_path, const spawn_file_actions &actions,
           string_vector &argv, string_vector &env);
 
+/**
+ * Wait for a process started with `spawn` to terminate, and reap it. It is
+ * forgotten before getting reaped, so that `kill_all` cannot signal another
+ * process that would reuse its pid.
+ */
+void wait(pid_t pid, int *status);
+
+/**
+ * Send a signal to the process group of each process started with `spawn`
+ * that wasn't reaped yet. This is safe to call from any thread.
+ */
+void kill_all(int sig);
+
 } // namespace system
 } // namespace upd
@@ -0,0 +1,148 @@
+#include "tool_process.h"
+#include "io/io.h"
+#include "system/spawn.h"
+#include <cstdint>
+#include <sys/wait.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace upd {
+
+const char *const WORKER_DEPFILE_PATH = "-";
+
+static void write_u32(std::string &target, uint32_t value) {
+  for (size_t i = 0; i < 4; ++i) {
+    target.push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+  }
+}
+
+static uint32_t read_u32(const char *data) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i]))
+             << (i * 8);
+  }
+  return value;
+}
+
+/**
+ * The status that `waitpid` would report for a process that exited normally
+ * with that code.
+ */
+static int get_exit_status(uint32_t code) { return (code & 0xff) << 8; }
+
+std::ostream &operator<<(std::ostream &os,
+                         const invalid_tool_response_error &) {
+  return os << "a persistent worker sent a response of invalid format";
+}
+
+std::string encode_tool_request(const command_line &target) {
+  std::string payload;
+  for (auto const &arg : target.args) {
+    payload.append(arg);
+    payload.push_back('\0');
+  }
+  std::string request;
+  write_u32(request, payload.size());
+  return request + payload;
+}
+
+bool tool_response_reader::push(const char *data, size_t size) {
+  buffer_.append(data, size);
+  if (buffer_.size() < 4) return false;
+  size_t payload_size = read_u32(buffer_.data());
+  if (buffer_.size() < 4 + payload_size) return false;
+  if (buffer_.size() > 4 + payload_size || payload_size < 8) {
+    throw invalid_tool_response_error();
+  }
+  const char *payload = buffer_.data() + 4;
+  size_t diagnostics_size = read_u32(payload + 4);
+  if (diagnostics_size > payload_size - 8) {
+    throw invalid_tool_response_error();
+  }
+  result.stdout.clear();
+  result.status = get_exit_status(read_u32(payload));
+  result.stderr.assign(payload + 8, diagnostics_size);
+  result.depfile.assign(payload + 8 + diagnostics_size,
+                        payload_size - 8 - diagnostics_size);
+  buffer_.clear();
+  return true;
+}
+
+tool_process::tool_process(const command_line_template &tpl)
+    : exited_(false) {
+  int request_fds[2];
+  io::pipe_cloexec(request_fds);
+  request_fd_ = io::file_descriptor(request_fds[1]);
+  io::file_descriptor request_read_fd(request_fds[0]);
+  int response_fds[2];
+  io::pipe_cloexec(response_fds);
+  response_fd_ = io::file_descriptor(response_fds[0]);
+  io::file_descriptor response_write_fd(response_fds[1]);
+
+  system::string_vector argv;
+  argv.push_back(tpl.binary_path);
+  for (auto const &arg : tpl.worker_args) {
+    argv.push_back(arg);
+  }
+  system::spawn_file_actions actions;
+  actions.add_dup2(request_read_fd, STDIN_FILENO);
+  actions.add_dup2(response_write_fd, STDOUT_FILENO);
+  system::string_vector env;
+  for (const auto &var : tpl.environment) {
+    env.push_back(var.first + "=" + var.second);
+  }
+  pid_ = system::spawn(tpl.binary_path, actions, argv, env);
+}
+
+/**
+ * Once its stdin is closed, the worker should finish the request in progress,
+ * if any, and terminate. We close its stdout first, so that it cannot get
+ * stuck writing a response that nobody reads.
+ */
+tool_process::~tool_process() {
+  if (exited_) return;
+  response_fd_.close();
+  request_fd_.close();
+  try {
+    system::wait(pid_, nullptr);
+  } catch (const std::system_error &) {
+  }
+}
+
+void tool_process::send(const command_line &target) {
+  auto request = encode_tool_request(target);
+  size_t offset = 0;
+  try {
+    while (offset < request.size()) {
+      offset += io::write(request_fd_, request.data() + offset,
+                          request.size() - offset);
+    }
+  } catch (const std::system_error &error) {
+    if (error.code() != std::errc::broken_pipe) throw;
+  }
+}
+
+command_line_result tool_process::run(const command_line &target) {
+  send(target);
+  tool_response_reader reader;
+  char buffer[1 << 12];
+  while (true) {
+    auto count = io::read(response_fd_, buffer, sizeof(buffer));
+    if (count == 0) return reap();
+    if (reader.push(buffer, count)) return std::move(reader.result);
+  }
+}
+
+command_line_result tool_process::reap() {
+  command_line_result result;
+  system::wait(pid_, &result.status);
+  exited_ = true;
+  result.stderr = "upd: error: worker process terminated before responding\n";
+  if (WIFEXITED(result.status) != 0 && WEXITSTATUS(result.status) == 0) {
+    result.status = get_exit_status(1);
+  }
+  return result;
+}
+
+} // namespace upd
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "command_line_template.h"
+#include "io/file_descriptor.h"
+#include "run_command_line.h"
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+
+namespace upd {
+
+/**
+ * What the `depfile` variable expands to for a persistent worker, as it
+ * returns the content of the depfile in its response instead of writing it.
+ */
+extern const char *const WORKER_DEPFILE_PATH;
+
+/**
+ * Encode the request to run a command line. A request is a little-endian
+ * 32-bit length, followed by that many bytes of payload. The payload is each
+ * argument of the command line, except the binary path, terminated by a null
+ * character.
+ */
+std::string encode_tool_request(const command_line &target);
+
+/**
+ * Thrown when the response of a persistent worker doesn't have the expected
+ * format.
+ */
+struct invalid_tool_response_error {};
+
+std::ostream &operator<<(std::ostream &os,
+                         const invalid_tool_response_error &);
+
+/**
+ * Decode the response to a request as it gets read. A response is a
+ * little-endian 32-bit length, followed by that many bytes of payload. The
+ * payload starts with the exit code and the size of the diagnostics, both
+ * little-endian 32-bit, then come the diagnostics, and the rest is the content
+ * of the depfile, if any.
+ */
+struct tool_response_reader {
+  /**
+   * Add what was read from the worker. Returns `true` once the response is
+   * complete, in which case `result` holds it. A worker is not supposed to
+   * write anything past its response, so that would be an error.
+   */
+  bool push(const char *data, size_t size);
+
+  command_line_result result;
+
+private:
+  std::string buffer_;
+};
+
+/**
+ * A tool that runs as a persistent worker: the process is started once with
+ * the binary path and the worker arguments of a template, and then runs the
+ * updates one after the other. It gets each request on its stdin, and writes
+ * the response on its stdout, while its stderr is the same as ours.
+ *
+ * Once we are done with the worker, we close its stdin, and it is expected to
+ * terminate then.
+ */
+struct tool_process {
+  tool_process(const command_line_template &tpl);
+  tool_process(tool_process &) = delete;
+  ~tool_process();
+
+  /**
+   * Write the request to run a command line. If the worker terminated, we
+   * find out when reading its response, that reaches the end of the file.
+   */
+  void send(const command_line &target);
+
+  /**
+   * Send a request and wait for the response. This blocks, so it's meant to
+   * be called from an `update_worker` thread.
+   */
+  command_line_result run(const command_line &target);
+
+  /**
+   * Wait for the worker to terminate, once it closed its stdout before
+   * completing a response, and describe that as a failed update.
+   */
+  command_line_result reap();
+
+  int response_fd() const { return response_fd_; }
+  bool exited() const { return exited_; }
+
+private:
+  pid_t pid_;
+  io::file_descriptor request_fd_;
+  io::file_descriptor response_fd_;
+  bool exited_;
+};
+
+} // namespace upd
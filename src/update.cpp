@@ -1,8 +1,12 @@
 #include "update.h"
 #include "command_line_template.h"
+#include "io/utils.h"
 #include "path.h"
 #include "run_command_line.h"
+#include "string_char_reader.h"
+#include "tool_process.h"
 #include "update_worker.h"
+#include <algorithm>
 #include <cstring>
 #include <fcntl.h>
 #include <stdexcept>
@@ -29,11 +33,15 @@ XXH64_hash_t hash(const command_line_template &cli_template) {
   cli_hash << hash(cli_template.binary_path);
   cli_hash << hash(cli_template.parts);
   cli_hash << hash(cli_template.environment);
+  // Templates that don't use a worker keep the same hash as before.
+  if (cli_template.persistent_worker) {
+    cli_hash << hash(cli_template.worker_args);
+  }
   return cli_hash.digest();
 }
 
 template <typename HashFile, typename Iter>
-XXH64_hash_t hash_files(HashFile hash_file, Iter first, Iter last) {
+XXH64_hash_t hash_files(HashFile &hash_file, Iter first, Iter last) {
   xxhash64_stream imprint_s(0);
   for (; first != last; ++first) {
     imprint_s << hash(*first) << hash_file(*first);
@@ -42,10 +50,99 @@ XXH64_hash_t hash_files(HashFile hash_file, Iter first, Iter last) {
 }
 
 template <typename HashFile, typename Cont>
-XXH64_hash_t hash_files(HashFile hash_file, const Cont &container) {
+XXH64_hash_t hash_files(HashFile &hash_file, const Cont &container) {
   return hash_files(hash_file, container.cbegin(), container.cend());
 }
 
+std::ostream &operator<<(std::ostream &os,
+                         const undeclared_rule_dependency_error &error) {
+  return os << "the output file `" << error.local_target_path
+            << "' was detected to depend on the generated file `"
+            << error.local_dependency_path << "'; it must be specified "
+            << "explicitly in the \"dependencies\" section of the rule, or "
+            << "listed for it by one of its dyndep files";
+}
+
+std::ostream &operator<<(std::ostream &os,
+                         const file_changed_manually_error &error) {
+  return os << "the file `" << error.local_file_path << "' "
+            << "has been modified manually and won't "
+            << "be overwritten in order to protect local changes; "
+            << "to resolve this issue, revert the file or delete it";
+}
+
+update_log::file_stat get_file_stat(const std::string &file_path) {
+  struct ::stat data;
+  if (io::stat(file_path.c_str(), &data) != 0) io::throw_errno();
+  return {static_cast<unsigned long long>(data.st_dev),
+          static_cast<unsigned long long>(data.st_ino),
+          static_cast<unsigned long long>(data.st_size),
+          io::get_mtime_ns(data), io::get_ctime_ns(data)};
+}
+
+typedef std::unordered_map<std::string, update_log::file_fingerprint>
+    fingerprints_by_path;
+
+/**
+ * Get the stat data of a file that we can trust to tell whether it changed.
+ * If the file is racy (see `is_mtime_racy`), we get an empty stat instead,
+ * that no file has, so that we hash the file rather than trust its stat data,
+ * now and when that stat gets recorded.
+ */
+static update_log::file_stat get_trusted_file_stat(
+    const std::string &file_path) {
+  auto now_ns = get_now_ns();
+  auto stat = get_file_stat(file_path);
+  if (is_mtime_racy(stat.mtime_ns, now_ns)) return update_log::file_stat();
+  return stat;
+}
+
+static bool is_trusted(const update_log::file_stat &stat) {
+  return !(stat == update_log::file_stat());
+}
+
+/**
+ * Hashes the files that go into the imprint of a target. If we know what
+ * fingerprint a file had the last time around, and its metadata didn't change
+ * since, we reuse the recorded hash rather than reading the file again. The
+ * fresh fingerprints are collected so that they can be recorded as well.
+ * Recorded fingerprints are indexed by entity id, that we resolve from paths
+ * with `ents`.
+ */
+struct fingerprint_hasher {
+  XXH64_hash_t operator()(const std::string &local_path) {
+    auto file_path = root_path + '/' + local_path;
+    update_log::file_fingerprint fingerprint;
+    fingerprint.stat = get_trusted_file_stat(file_path);
+    auto known = find_known_fingerprint_(local_path);
+    if (known != nullptr && is_trusted(fingerprint.stat) &&
+        known->stat == fingerprint.stat) {
+      fingerprint.hash = known->hash;
+    } else {
+      fingerprint.hash = hash_cache.hash(file_path);
+    }
+    if (fingerprints != nullptr) (*fingerprints)[local_path] = fingerprint;
+    return fingerprint.hash;
+  }
+
+  file_hash_cache &hash_cache;
+  const std::string &root_path;
+  const update_log::ent_table &ents;
+  const update_log::fingerprints_by_ent_id *known_fingerprints;
+  fingerprints_by_path *fingerprints;
+
+private:
+  const update_log::file_fingerprint *
+  find_known_fingerprint_(const std::string &local_path) {
+    if (known_fingerprints == nullptr) return nullptr;
+    auto ent_id = ents.find_path(local_path);
+    if (ent_id == update_log::ent_table::no_id) return nullptr;
+    auto iter = known_fingerprints->find(ent_id);
+    if (iter == known_fingerprints->end()) return nullptr;
+    return &iter->second;
+  }
+};
+
 typedef std::vector<std::string> string_vec;
 struct imprint_dep_paths {
   const string_vec &inputs;
@@ -53,13 +150,9 @@ struct imprint_dep_paths {
   const string_vec &dyn_deps;
 };
 
-XXH64_hash_t get_target_imprint(file_hash_cache &hash_cache,
-                                const std::string &root_path,
+XXH64_hash_t get_target_imprint(fingerprint_hasher &hash_file,
                                 const imprint_dep_paths &dep_paths,
                                 const command_line_template &cli_template) {
-  auto hash_file = [&root_path, &hash_cache](const std::string &file_path) {
-    return hash_cache.hash(root_path + '/' + file_path);
-  };
   xxhash64_stream imprint_s(0);
   imprint_s << hash(cli_template);
   imprint_s << hash_files(hash_file, dep_paths.inputs);
@@ -70,21 +163,39 @@ XXH64_hash_t get_target_imprint(file_hash_cache &hash_cache,
   return imprint_s.digest();
 }
 
-bool is_file_up_to_date(update_log::cache &log_cache,
+/**
+ * Hash the content of a target file, unless its metadata shows it didn't
+ * change since we recorded it. `stat` is set to the metadata we could trust.
+ */
+static XXH64_hash_t hash_target(file_hash_cache &hash_cache,
+                                const std::string &target_path,
+                                const update_log::file_record &record,
+                                update_log::file_stat &stat) {
+  stat = get_trusted_file_stat(target_path);
+  if (is_trusted(stat) && stat == record.stat) {
+    return record.hash;
+  }
+  return hash_cache.hash(target_path);
+}
+
+bool is_file_up_to_date(const update_log::file_record *record,
+                        const update_log::ent_table &ents,
                         file_hash_cache &hash_cache,
                         const std::string &root_path,
                         const std::string &local_target_path,
                         const std::vector<std::string> &local_src_paths,
                         const std::vector<std::vector<std::string>> &dep_groups,
-                        const command_line_template &cli_template) {
-  auto entry = log_cache.find(local_target_path);
-  if (entry == log_cache.end()) {
+                        const command_line_template &cli_template,
+                        update_log::file_stat &new_stat) {
+  new_stat = update_log::file_stat();
+  if (record == nullptr) {
     return false;
   }
-  auto const &record = entry->second;
+  update_log::file_stat stat;
   try {
-    auto new_hash = hash_cache.hash(root_path + "/" + local_target_path);
-    if (new_hash != record.hash) {
+    auto new_hash = hash_target(hash_cache, root_path + "/" + local_target_path,
+                                *record, stat);
+    if (new_hash != record->hash) {
       throw file_changed_manually_error{local_target_path};
     }
   } catch (const std::system_error &error) {
@@ -94,11 +205,18 @@ bool is_file_up_to_date(update_log::cache &log_cache,
     return false;
   }
   try {
-    imprint_dep_paths deps_paths{local_src_paths, dep_groups,
-                                 record.dependency_local_paths};
-    auto new_imprint =
-        get_target_imprint(hash_cache, root_path, deps_paths, cli_template);
-    return new_imprint == record.imprint;
+    string_vec dep_local_paths;
+    dep_local_paths.reserve(record->dependency_ent_ids.size());
+    for (auto ent_id : record->dependency_ent_ids) {
+      dep_local_paths.push_back(ents.get_path(ent_id));
+    }
+    imprint_dep_paths deps_paths{local_src_paths, dep_groups, dep_local_paths};
+    fingerprint_hasher hash_file{hash_cache, root_path, ents,
+                                 &record->input_fingerprints, nullptr};
+    auto new_imprint = get_target_imprint(hash_file, deps_paths, cli_template);
+    if (new_imprint != record->imprint) return false;
+    if (is_trusted(stat) && !(stat == record->stat)) new_stat = stat;
+    return true;
   } catch (const std::system_error &error) {
     if (error.code() != std::errc::no_such_file_or_directory) {
       throw;
@@ -107,104 +225,130 @@ bool is_file_up_to_date(update_log::cache &log_cache,
   }
 }
 
-scheduled_file_update::scheduled_file_update() {}
-
-scheduled_file_update::scheduled_file_update(
-    update_job &&job_,
-    std::future<std::unique_ptr<depfile::depfile_data>> &&read_depfile_future_,
-    const std::string &depfile_path_, io::file_descriptor &&depfile_dummy_fd_)
-    : job(std::move(job_)),
-      read_depfile_future(std::move(read_depfile_future_)),
-      depfile_path(depfile_path_),
-      depfile_dummy_fd(std::move(depfile_dummy_fd_)) {}
-
-scheduled_file_update::scheduled_file_update(scheduled_file_update &&other)
-    : job(std::move(other.job)),
-      read_depfile_future(std::move(other.read_depfile_future)),
-      depfile_path(std::move(other.depfile_path)),
-      depfile_dummy_fd(std::move(other.depfile_dummy_fd)) {}
-
-scheduled_file_update &scheduled_file_update::
-operator=(scheduled_file_update &&other) {
-  job = std::move(other.job);
-  read_depfile_future = std::move(other.read_depfile_future);
-  depfile_path = std::move(other.depfile_path);
-  depfile_dummy_fd = std::move(other.depfile_dummy_fd);
-  return *this;
-}
-
-static std::string TEMPLATE = "/tmp/upd.XXXXXX";
-
 scheduled_file_update
 schedule_file_update(update_context &cx,
                      const command_line_template &cli_template,
                      const std::vector<std::string> &local_src_paths,
-                     const std::string &local_target_path,
+                     const std::vector<std::string> &local_target_paths,
+                     const std::vector<std::string> &local_output_paths,
                      const std::vector<std::vector<std::string>> &dep_groups) {
-
-  std::string depfile_path = io::mkdtemp_s(TEMPLATE) + "/dep";
-  if (io::mkfifo(depfile_path.c_str(), 0700) != 0) io::throw_errno();
-
-  command_line_parameters params = {
-      depfile_path, local_src_paths, {local_target_path}, dep_groups};
-  auto command_line =
-      reify_command_line(cli_template, params, cx.root_path, io::getcwd());
-  std::cout << "updating: " << local_target_path << std::endl;
+  auto depfile_path =
+      cli_template.persistent_worker ? WORKER_DEPFILE_PATH : DEPFILE_PATH;
+  command_line_parameters params = {depfile_path, local_src_paths,
+                                    local_target_paths, dep_groups};
+  auto command_line = reify_command_line(
+      cli_template, params, cx.root_path, io::getcwd(),
+      [&cx](const std::string &content) {
+        return cx.scratch.write_file(".rsp", content);
+      });
+  for (auto const &local_target_path : local_target_paths) {
+    std::cout << "updating: " << local_target_path << std::endl;
+  }
   if (cx.print_commands) {
     std::cout << "$ " << command_line << std::endl;
   }
-  cx.dir_cache.create(dirname(local_target_path));
-  auto read_depfile_future =
-      std::async(std::launch::async, &depfile::read, depfile_path);
-  cx.hash_cache.invalidate(cx.root_path + '/' + local_target_path);
+  for (auto const &local_output_path : local_output_paths) {
+    cx.dir_cache.create(dirname(local_output_path));
+    cx.hash_cache.invalidate(cx.root_path + '/' + local_output_path);
+  }
+  bool has_depfile =
+      !cli_template.persistent_worker &&
+      has_variable(cli_template, command_line_template_variable::depfile);
+  return {{cx.root_path, command_line, has_depfile, nullptr, nullptr}};
+}
 
-  int fd = io::open(depfile_path, O_WRONLY, 0600);
-  io::file_descriptor depfile_dummy_fd(fd);
+std::vector<std::vector<std::string>>
+get_depfile_dependencies(update_context &cx, const std::string &depfile,
+                         const std::vector<std::string> &local_target_paths) {
+  string_char_reader depfile_reader(depfile);
+  auto rules = depfile::parse_rules(depfile_reader);
+  std::vector<std::vector<std::string>> result(local_target_paths.size());
+  auto working_path = io::getcwd();
+  for (auto &rule : rules) {
+    size_t target_ix = 0;
+    if (local_target_paths.size() > 1) {
+      auto target_path =
+          get_relative_path(cx.root_path, rule.target_path, working_path);
+      auto iter = std::find(local_target_paths.begin(),
+                            local_target_paths.end(), target_path);
+      if (iter == local_target_paths.end()) continue;
+      target_ix = iter - local_target_paths.begin();
+    }
+    auto &deps = result[target_ix];
+    deps.insert(deps.end(), rule.dependency_paths.begin(),
+                rule.dependency_paths.end());
+  }
+  return result;
+}
 
-  return scheduled_file_update({cx.root_path, command_line},
-                               std::move(read_depfile_future), depfile_path,
-                               std::move(depfile_dummy_fd));
+std::vector<depfile::depfile_data>
+read_dyndep_file(update_context &cx, const std::string &local_path) {
+  string_char_reader reader(
+      io::read_entire_file(cx.root_path + '/' + local_path));
+  auto rules = depfile::parse_rules(reader);
+  auto working_path = io::getcwd();
+  for (auto &rule : rules) {
+    rule.target_path =
+        get_relative_path(cx.root_path, rule.target_path, working_path);
+    for (auto &dependency_path : rule.dependency_paths) {
+      dependency_path =
+          get_relative_path(cx.root_path, dependency_path, working_path);
+    }
+  }
+  return rules;
 }
 
-void finalize_scheduled_update(
-    update_context &cx, scheduled_file_update &sfu,
+update_log::file_record finalize_scheduled_update(
+    update_context &cx, const std::vector<std::string> &dependency_paths,
     const command_line_template &cli_template,
     const std::vector<std::string> &local_src_paths,
     const std::vector<string_vec> &dep_groups,
     const std::string &local_target_path, const update_map &updm,
-    const std::unordered_set<std::string> &order_only_dependency_file_paths) {
-
-  sfu.depfile_dummy_fd.close();
-  std::unique_ptr<depfile::depfile_data> depfile_data =
-      sfu.read_depfile_future.get();
-  if (io::unlink(sfu.depfile_path.c_str()) != 0) io::throw_errno();
-  if (io::rmdir(dirname(sfu.depfile_path).c_str()) != 0) io::throw_errno();
+    const std::unordered_set<std::string> &order_only_dependency_file_paths,
+    const std::unordered_set<std::string> &dyndep_dependency_paths,
+    const update_log::file_record *previous_record) {
 
   auto root_folder_path = cx.root_path + '/';
 
   std::vector<std::string> dep_local_paths;
   std::unordered_set<std::string> local_src_path_set(local_src_paths.begin(),
                                                      local_src_paths.end());
-  if (depfile_data) {
-    for (auto dep_path : depfile_data->dependency_paths) {
-      dep_path = get_relative_path(cx.root_path, dep_path, io::getcwd());
-      if (local_src_path_set.find(dep_path) != local_src_path_set.end()) {
-        continue;
-      }
-      if (updm.output_files_by_path.find(dep_path) !=
-              updm.output_files_by_path.end() &&
-          order_only_dependency_file_paths.count(dep_path) == 0) {
-        throw undeclared_rule_dependency_error({local_target_path, dep_path});
-      }
-      dep_local_paths.push_back(dep_path);
+  for (auto dep_path : dependency_paths) {
+    dep_path = get_relative_path(cx.root_path, dep_path, io::getcwd());
+    if (local_src_path_set.find(dep_path) != local_src_path_set.end()) {
+      continue;
+    }
+    if (updm.output_files_by_path.find(dep_path) !=
+            updm.output_files_by_path.end() &&
+        order_only_dependency_file_paths.count(dep_path) == 0 &&
+        dyndep_dependency_paths.count(dep_path) == 0) {
+      throw undeclared_rule_dependency_error({local_target_path, dep_path});
     }
+    dep_local_paths.push_back(dep_path);
   }
+  auto &ents = cx.log_cache.ents();
+  const update_log::fingerprints_by_ent_id *known_fingerprints =
+      previous_record == nullptr ? nullptr
+                                 : &previous_record->input_fingerprints;
+  fingerprints_by_path fingerprints;
   imprint_dep_paths deps_paths{local_src_paths, dep_groups, dep_local_paths};
-  auto new_imprint =
-      get_target_imprint(cx.hash_cache, cx.root_path, deps_paths, cli_template);
-  auto new_hash = cx.hash_cache.hash(root_folder_path + local_target_path);
-  cx.log_cache.record(local_target_path,
-                      {new_imprint, new_hash, dep_local_paths});
+  fingerprint_hasher hash_file{cx.hash_cache, cx.root_path, ents,
+                               known_fingerprints, &fingerprints};
+  auto new_imprint = get_target_imprint(hash_file, deps_paths, cli_template);
+  auto target_path = root_folder_path + local_target_path;
+  auto target_stat = get_trusted_file_stat(target_path);
+  auto new_hash = cx.hash_cache.hash(target_path);
+  std::vector<size_t> dep_ent_ids;
+  dep_ent_ids.reserve(dep_local_paths.size());
+  for (auto const &dep_local_path : dep_local_paths) {
+    dep_ent_ids.push_back(ents.add_path(dep_local_path));
+  }
+  update_log::file_record record{
+      new_imprint, new_hash, std::move(dep_ent_ids), target_stat, {}, 0};
+  for (auto const &entry : fingerprints) {
+    record.input_fingerprints[ents.add_path(entry.first)] = entry.second;
+  }
+  return record;
 }
 
 } // namespace upd
@@ -3,10 +3,11 @@
 #include "depfile/read.h"
 #include "directory_cache.h"
 #include "io/file_descriptor.h"
+#include "scratch_dir.h"
 #include "update_log/cache.h"
 #include "update_worker.h"
 #include "xxhash64.h"
-#include <future>
+#include <ostream>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -52,6 +53,19 @@ struct update_context {
    * using all cores will yield the fastest update.
    */
   size_t concurrency;
+
+  /**
+   * How many updates can fail before we stop starting new ones, so that the
+   * files that don't depend on the failed ones still get updated. Zero means
+   * there is no limit.
+   */
+  size_t failure_limit;
+
+  /**
+   * Where the response files of update commands go. They are removed once
+   * all the updates are done.
+   */
+  scratch_dir scratch;
 };
 
 struct output_file {
@@ -59,12 +73,34 @@ struct output_file {
   std::vector<std::string> local_input_file_paths;
   std::vector<std::vector<std::string>> dependency_groups;
   std::unordered_set<std::string> order_only_dependency_file_paths;
+  /**
+   * Generated files that may list more dependencies of the file, once they
+   * are updated. They are otherwise like order-only dependencies.
+   */
+  std::unordered_set<std::string> dyndep_file_paths;
+  /**
+   * The rule that generates the file. Files of the same rule can be updated
+   * by a single command, up to `batch_size` at a time, if that's more than 1.
+   */
+  size_t rule_ix;
+  size_t batch_size;
+  /**
+   * All the files that the command updates at once, in the order of the
+   * patterns of the rule. The first one is the one that gets scheduled, and
+   * the `output_files` variable only lists that one. The others are updated,
+   * and considered updated, with it.
+   */
+  std::vector<std::string> local_output_paths;
 };
 
 typedef std::unordered_map<std::string, output_file> output_files_by_path_t;
 
 struct update_map {
   output_files_by_path_t output_files_by_path;
+  /**
+   * The dyndep files of all the output files.
+   */
+  std::unordered_set<std::string> dyndep_file_paths;
 };
 
 struct undeclared_rule_dependency_error {
@@ -72,53 +108,104 @@ struct undeclared_rule_dependency_error {
   std::string local_dependency_path;
 };
 
+std::ostream &operator<<(std::ostream &os,
+                         const undeclared_rule_dependency_error &error);
+
 XXH64_hash_t hash_command_line(const command_line &command_line);
 
 XXH64_hash_t hash_files(file_hash_cache &hash_cache,
                         const std::string &root_path,
                         const std::vector<std::string> &local_paths);
 
+/**
+ * Get the metadata of a file that we use to detect changes to it without
+ * reading its content. Throws a `std::system_error` if the file is missing.
+ */
+update_log::file_stat get_file_stat(const std::string &file_path);
+
 struct file_changed_manually_error {
   std::string local_file_path;
 };
 
-bool is_file_up_to_date(update_log::cache &log_cache,
+std::ostream &operator<<(std::ostream &os,
+                         const file_changed_manually_error &error);
+
+/**
+ * Check if a target needs to be updated again, given the `record` of its last
+ * update, that is `nullptr` if it was never updated. The paths of the record
+ * are resolved with `ents`. This is safe to call from several threads at once.
+ *
+ * A target is usually still racy when it gets recorded, in which case its
+ * record has no stat data. Once it isn't racy anymore and turns out to be
+ * up-to-date, `new_stat` is set to the stat data it had when we hashed it, so
+ * that the record can be refreshed and we don't need to hash it again next
+ * time. It's left empty otherwise.
+ */
+bool is_file_up_to_date(const update_log::file_record *record,
+                        const update_log::ent_table &ents,
                         file_hash_cache &hash_cache,
                         const std::string &root_path,
                         const std::string &local_target_path,
                         const std::vector<std::string> &local_src_paths,
                         const std::vector<std::vector<std::string>> &dep_groups,
-                        const command_line_template &cli_template);
+                        const command_line_template &cli_template,
+                        update_log::file_stat &new_stat);
 
 struct scheduled_file_update {
-  scheduled_file_update();
-  scheduled_file_update(
-      update_job &&job,
-      std::future<std::unique_ptr<depfile::depfile_data>> &&read_depfile_future,
-      const std::string &depfile_path, io::file_descriptor &&depfile_dummy_fd);
-  scheduled_file_update(scheduled_file_update &) = delete;
-  scheduled_file_update(scheduled_file_update &&);
-  scheduled_file_update &operator=(scheduled_file_update &&);
-
   update_job job;
-  std::future<std::unique_ptr<depfile::depfile_data>> read_depfile_future;
-  std::string depfile_path;
-  io::file_descriptor depfile_dummy_fd;
 };
 
+/**
+ * Prepare the command that updates one or several targets. Targets are only
+ * updated together if they come from the same rule, in which case
+ * `local_src_paths` are the inputs of all of them, in the same order.
+ * `local_output_paths` are all the files that the command updates, including
+ * the targets and their other outputs, if any.
+ */
 scheduled_file_update
 schedule_file_update(update_context &cx,
                      const command_line_template &cli_template,
                      const std::vector<std::string> &local_src_paths,
-                     const std::string &local_target_path,
+                     const std::vector<std::string> &local_target_paths,
+                     const std::vector<std::string> &local_output_paths,
                      const std::vector<std::vector<std::string>> &dep_groups);
 
-void finalize_scheduled_update(
-    update_context &cx, scheduled_file_update &sfu,
+/**
+ * Get what the command wrote to its depfile, as the dependencies of each of
+ * the targets it updated, in the same order. With a single target, all the
+ * rules of the depfile are about it. Otherwise, each rule is about the target
+ * it names, and rules naming some other file are ignored.
+ */
+std::vector<std::vector<std::string>>
+get_depfile_dependencies(update_context &cx, const std::string &depfile,
+                         const std::vector<std::string> &local_target_paths);
+
+/**
+ * Read a dyndep file, once it is updated. It has the same format as a
+ * depfile, with a rule for each target that has more dependencies than the
+ * manifest declares. All the paths of the result are local.
+ */
+std::vector<depfile::depfile_data>
+read_dyndep_file(update_context &cx, const std::string &local_path);
+
+/**
+ * Once the update command succeeded, collect the dependencies it reported
+ * in its depfile for that target, and compute the new record for the target.
+ * The generated files it depends on must either be order-only dependencies,
+ * or be listed for that target by one of its dyndep files.
+ * `previous_record` is the record of the last update, if any.
+ * This doesn't touch the update log, so that it can be called from any thread;
+ * the caller is responsible for recording the result, along with the duration
+ * of the update.
+ */
+update_log::file_record finalize_scheduled_update(
+    update_context &cx, const std::vector<std::string> &dependency_paths,
     const command_line_template &cli_template,
     const std::vector<std::string> &local_src_paths,
     const std::vector<std::vector<std::string>> &dep_groups,
     const std::string &local_target_path, const update_map &updm,
-    const std::unordered_set<std::string> &local_dependency_file_paths);
+    const std::unordered_set<std::string> &local_dependency_file_paths,
+    const std::unordered_set<std::string> &dyndep_dependency_paths,
+    const update_log::file_record *previous_record);
 
 } // namespace upd
@@ -15,13 +15,51 @@
 namespace upd {
 namespace update_log {
 
-cache::cache(const std::string &file_path, const cache_file_data &data)
-    : recorder_(file_path, data.ent_paths), cached_records_(data.records) {}
+/**
+ * We only compact the log once at least this share of its records are
+ * superseded, as rewriting it entirely costs more than reading a few
+ * duplicates.
+ */
+static constexpr double COMPACTION_THRESHOLD = 0.25;
 
-cache::cache(const std::string &file_path) : recorder_(file_path) {}
+cache::cache(const std::string &file_path, cache_file_data &&data)
+    : ents_(data.ents), dep_sets_(data.dep_sets),
+      recorder_(file_path, data.ents, data.dep_sets, data.valid_size),
+      mapped_records_(std::move(data.records)),
+      log_record_count_(data.record_count), appended_record_count_(0),
+      dropped_record_count_(0) {}
+
+cache::cache(const std::string &file_path)
+    : ents_(std::make_shared<ent_table>()),
+      dep_sets_(std::make_shared<dependency_set_table>()),
+      recorder_(file_path, ents_, dep_sets_),
+      log_record_count_(0), appended_record_count_(0),
+      dropped_record_count_(0) {}
 
 records_by_file::iterator cache::find(const std::string &local_file_path) {
-  return cached_records_.find(local_file_path);
+  auto iter = cached_records_.find(local_file_path);
+  if (iter != cached_records_.end() || mapped_records_.empty()) return iter;
+  auto ent_id = ents_->find_path(local_file_path);
+  if (ent_id == ent_table::no_id) return cached_records_.end();
+  auto mapped_iter = mapped_records_.find(ent_id);
+  if (mapped_iter == mapped_records_.end()) return cached_records_.end();
+  file_record record;
+  auto is_valid = try_read_update_record(*ents_, *dep_sets_,
+                                         mapped_iter->second, record);
+  mapped_records_.erase(mapped_iter);
+  if (!is_valid) return cached_records_.end();
+  return cached_records_.emplace(local_file_path, std::move(record)).first;
+}
+
+const records_by_file &cache::records() {
+  for (auto const &entry : mapped_records_) {
+    file_record record;
+    if (!try_read_update_record(*ents_, *dep_sets_, entry.second, record))
+      continue;
+    cached_records_.emplace(ents_->get_path(entry.first), std::move(record));
+  }
+  mapped_records_.clear();
+  return cached_records_;
 }
 
 records_by_file::iterator cache::end() { return cached_records_.end(); }
@@ -29,7 +67,44 @@ records_by_file::iterator cache::end() { return cached_records_.end(); }
 void cache::record(const std::string &local_file_path,
                    const file_record &record) {
   recorder_.record(local_file_path, record);
-  cached_records_[local_file_path] = record;
+  auto &cached_record = cached_records_[local_file_path] = record;
+  // Share the set that the recorder defined, if another record has the same.
+  auto const &deps = record.dependency_ent_ids;
+  auto dep_set_id = dep_sets_->find(dependency_set_table::hash(deps), deps);
+  cached_record.dependency_ent_ids = dep_sets_->get(dep_set_id);
+  if (!mapped_records_.empty()) {
+    auto ent_id = ents_->find_path(local_file_path);
+    mapped_records_.erase(ent_id);
+  }
+  ++log_record_count_;
+  ++appended_record_count_;
+}
+
+void cache::drop_records(
+    const std::function<bool(const std::string &)> &is_stale) {
+  for (auto iter = cached_records_.begin(); iter != cached_records_.end();) {
+    if (!is_stale(iter->first)) {
+      ++iter;
+      continue;
+    }
+    iter = cached_records_.erase(iter);
+    ++dropped_record_count_;
+  }
+  for (auto iter = mapped_records_.begin(); iter != mapped_records_.end();) {
+    if (!is_stale(ents_->get_path(iter->first))) {
+      ++iter;
+      continue;
+    }
+    iter = mapped_records_.erase(iter);
+    ++dropped_record_count_;
+  }
+}
+
+bool cache::needs_compaction() const {
+  if (appended_record_count_ == 0 && dropped_record_count_ == 0) return false;
+  auto superseded_count =
+      log_record_count_ - cached_records_.size() - mapped_records_.size();
+  return superseded_count >= COMPACTION_THRESHOLD * log_record_count_;
 }
 
 cache cache::from_log_file(const std::string &log_file_path) {
@@ -40,21 +115,74 @@ cache cache::from_log_file(const std::string &log_file_path) {
     if (error.code() != std::errc::no_such_file_or_directory) throw;
     return cache(log_file_path);
   }
+  auto file = std::make_shared<io::mapped_file>(fd);
   try {
-    return cache(log_file_path, read_fd(fd));
+    return cache(log_file_path, read_mapped(file));
   } catch (const version_mismatch_error &) {
     return cache(log_file_path);
   }
 }
 
+typedef std::unordered_map<const std::vector<size_t> *, dependency_set>
+    translated_dep_sets;
+
+static size_t translate_ent_id(size_t ent_id, const ent_table &ents,
+                               ent_table &new_ents) {
+  return new_ents.add_path(ents.get_path(ent_id));
+}
+
+/**
+ * Get the same record, with ids of entities in `new_ents` rather than `ents`.
+ * Dependency sets are shared by many records, so each is only translated
+ * once.
+ */
+static file_record translate_record(const file_record &record,
+                                    const ent_table &ents, ent_table &new_ents,
+                                    translated_dep_sets &dep_sets) {
+  file_record result{record.imprint, record.hash, {}, record.stat, {},
+                     record.duration_ms};
+  auto const &dep_ent_ids = record.dependency_ent_ids.ent_ids();
+  auto dep_set_iter = dep_sets.find(&dep_ent_ids);
+  if (dep_set_iter == dep_sets.end()) {
+    std::vector<size_t> new_dep_ent_ids;
+    new_dep_ent_ids.reserve(dep_ent_ids.size());
+    for (auto ent_id : dep_ent_ids) {
+      new_dep_ent_ids.push_back(translate_ent_id(ent_id, ents, new_ents));
+    }
+    dep_set_iter = dep_sets
+                       .emplace(&dep_ent_ids,
+                                dependency_set(std::move(new_dep_ent_ids)))
+                       .first;
+  }
+  result.dependency_ent_ids = dep_set_iter->second;
+  for (auto const &entry : record.input_fingerprints) {
+    auto new_ent_id = translate_ent_id(entry.first, ents, new_ents);
+    result.input_fingerprints[new_ent_id] = entry.second;
+  }
+  return result;
+}
+
 void rewrite_file(const std::string &file_path,
                   const std::string &temporary_file_path,
-                  const records_by_file &records) {
-  recorder fresh_recorder(temporary_file_path);
-  for (auto record_entry : records) {
-    fresh_recorder.record(record_entry.first, record_entry.second);
+                  const records_by_file &records, const ent_table &ents) {
+  std::vector<char> buf{VERSION};
+  auto new_ents = std::make_shared<ent_table>();
+  record_encoder encoder(new_ents, std::make_shared<dependency_set_table>());
+  translated_dep_sets dep_sets;
+  for (auto const &record_entry : records) {
+    auto record =
+        translate_record(record_entry.second, ents, *new_ents, dep_sets);
+    encoder.encode(buf, record_entry.first, record);
+  }
+  {
+    io::file_descriptor fd =
+        io::open(temporary_file_path, O_WRONLY | O_CREAT | O_TRUNC,
+                 S_IRUSR | S_IWUSR);
+    for (size_t i = 0; i < buf.size();) {
+      i += io::write(fd, buf.data() + i, buf.size() - i);
+    }
+    io::fdatasync(fd);
   }
-  fresh_recorder.close();
   if (io::rename(temporary_file_path.c_str(), file_path.c_str()) != 0)
     io::throw_errno();
 }
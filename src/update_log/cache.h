@@ -2,8 +2,12 @@
 
 #include "../../gen/src/update_log/file_record.h"
 #include "../io/file_descriptor.h"
+#include "../io/utils.h"
+#include "dependency_set.h"
+#include "ent_table.h"
 #include "recorder.h"
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <unordered_map>
 #include <vector>
@@ -12,30 +16,91 @@ namespace upd {
 namespace update_log {
 
 typedef std::unordered_map<std::string, file_record> records_by_file;
+typedef std::unordered_map<size_t, file_fingerprint> fingerprints_by_ent_id;
+
+/**
+ * An update record that wasn't decoded yet, in a log file mapped in memory.
+ */
+struct mapped_record {
+  const char *data;
+  size_t size;
+};
+
+typedef std::unordered_map<size_t, mapped_record> mapped_records_by_ent_id;
+
 struct cache_file_data {
-  records_by_file records;
-  string_vector ent_paths;
+  /**
+   * The entities of the log, that keep the file mapped in memory.
+   */
+  std::shared_ptr<ent_table> ents;
+  /**
+   * The dependency sets that update records refer to.
+   */
+  std::shared_ptr<dependency_set_table> dep_sets;
+  /**
+   * The latest update record of each file.
+   */
+  mapped_records_by_ent_id records;
+  /**
+   * How many bytes at the start of the file hold valid records. Anything
+   * after that was only partially written, for example because of a crash,
+   * or is corrupted, and gets truncated when we append to the log.
+   */
+  size_t valid_size;
+  /**
+   * How many update records the file holds, including the ones that are
+   * superseded by a later record for the same file.
+   */
+  size_t record_count;
 };
 
 /**
  * We keep of copy of the update log in memory. New elements added to the
- * cache are persisted right away (see `recorder`).
+ * cache are persisted right away (see `recorder`). The records of the log file
+ * are only decoded the first time they're looked up, as most runs only need
+ * a few of them. A record that turns out to be corrupted is dropped, so that
+ * the file gets updated again.
  */
 struct cache {
-  cache(const std::string &file_path, const cache_file_data &data);
+  cache(const std::string &file_path, cache_file_data &&data);
   cache(const std::string &file_path);
   records_by_file::iterator find(const std::string &local_file_path);
   records_by_file::iterator end();
   void record(const std::string &local_file_path, const file_record &record);
   void close() { recorder_.close(); }
-  const records_by_file &records() const { return cached_records_; }
+  /**
+   * The entities that the paths of records refer to. New paths must be added
+   * to it before being used in a record.
+   */
+  ent_table &ents() { return *ents_; }
+  /**
+   * All the records, that are decoded at that point if they were not already.
+   */
+  const records_by_file &records();
+  /**
+   * Forget the records of the files for which `is_stale` returns `true`, for
+   * example because no rule generates them anymore. They disappear from the
+   * log file the next time it is rewritten.
+   */
+  void drop_records(const std::function<bool(const std::string &)> &is_stale);
+  /**
+   * Whether the log is worth rewriting, because we appended or dropped records
+   * and enough of its records are superseded or dropped.
+   */
+  bool needs_compaction() const;
   static records_by_file
   records_from_log_file(const std::string &log_file_path);
   static cache from_log_file(const std::string &log_file_path);
 
 private:
+  std::shared_ptr<ent_table> ents_;
+  std::shared_ptr<dependency_set_table> dep_sets_;
   recorder recorder_;
   records_by_file cached_records_;
+  mapped_records_by_ent_id mapped_records_;
+  size_t log_record_count_;
+  size_t appended_record_count_;
+  size_t dropped_record_count_;
 };
 
 struct failed_to_rewrite_error {};
@@ -45,11 +110,13 @@ struct failed_to_rewrite_error {};
  * update log, but there may be duplicates. To finalize the log, we rewrite it
  * from scratch, and we replace the existing log using a file rename. `rename`
  * is normally an atomic operation, so we ensure no data is lost even if the
- * process crashes right in the middle of the rewrite.
+ * process crashes right in the middle of the rewrite. The new log is
+ * serialized in memory, and written and flushed to disk all at once. Only the
+ * entities that `records` refer to, in `ents`, are kept in the new log.
  */
 void rewrite_file(const std::string &file_path,
                   const std::string &temporary_file_path,
-                  const records_by_file &records);
+                  const records_by_file &records, const ent_table &ents);
 
 } // namespace update_log
 } // namespace upd
@@ -0,0 +1,48 @@
+#include "dependency_set.h"
+#include "../xxhash.h"
+
+namespace upd {
+namespace update_log {
+
+const std::vector<size_t> &dependency_set::ent_ids() const {
+  static const std::vector<size_t> empty;
+  if (!ent_ids_) return empty;
+  return *ent_ids_;
+}
+
+bool operator==(const dependency_set &left, const dependency_set &right) {
+  return &left.ent_ids() == &right.ent_ids() ||
+         left.ent_ids() == right.ent_ids();
+}
+
+std::string inspect(const dependency_set &value,
+                    const inspect_options &options) {
+  return inspect(value.ent_ids(), options);
+}
+
+constexpr size_t dependency_set_table::no_id;
+
+unsigned long long dependency_set_table::hash(const dependency_set &set) {
+  auto const &ent_ids = set.ent_ids();
+  return XXH64(ent_ids.data(), ent_ids.size() * sizeof(size_t), 0);
+}
+
+size_t dependency_set_table::find(unsigned long long hash,
+                                  const dependency_set &set) const {
+  auto range = ids_by_hash_.equal_range(hash);
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (sets_[iter->second] == set) return iter->second;
+  }
+  return no_id;
+}
+
+size_t dependency_set_table::add(unsigned long long hash,
+                                 const dependency_set &set) {
+  auto id = sets_.size();
+  sets_.push_back(set);
+  ids_by_hash_.emplace(hash, id);
+  return id;
+}
+
+} // namespace update_log
+} // namespace upd
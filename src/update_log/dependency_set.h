@@ -0,0 +1,65 @@
+#pragma once
+
+#include "../inspect.h"
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace upd {
+namespace update_log {
+
+/**
+ * The ids of the entities a file depends on, in addition to its sources (see
+ * `file_record`). Many files have the very same dependencies, for example the
+ * objects of a C++ project that include the same headers, so copies of a set
+ * share a single list rather than duplicating it.
+ */
+struct dependency_set {
+  dependency_set() {}
+  dependency_set(std::initializer_list<size_t> ent_ids)
+      : ent_ids_(std::make_shared<std::vector<size_t>>(ent_ids)) {}
+  dependency_set(std::vector<size_t> &&ent_ids)
+      : ent_ids_(std::make_shared<std::vector<size_t>>(std::move(ent_ids))) {}
+
+  const std::vector<size_t> &ent_ids() const;
+  std::vector<size_t>::const_iterator begin() const {
+    return ent_ids().begin();
+  }
+  std::vector<size_t>::const_iterator end() const { return ent_ids().end(); }
+  size_t size() const { return ent_ids().size(); }
+  size_t operator[](size_t ix) const { return ent_ids()[ix]; }
+
+private:
+  std::shared_ptr<const std::vector<size_t>> ent_ids_;
+};
+
+bool operator==(const dependency_set &left, const dependency_set &right);
+std::string inspect(const dependency_set &value,
+                    const inspect_options &options);
+
+/**
+ * The dependency sets defined by an update log. Ids are assigned in order,
+ * starting from zero. Sets are indexed by a hash of their content, so that
+ * each distinct set is only defined once.
+ */
+struct dependency_set_table {
+  static constexpr size_t no_id = ~static_cast<size_t>(0);
+  static unsigned long long hash(const dependency_set &set);
+
+  /**
+   * Returns the id of a set with the same content, or `no_id` if there is
+   * none. `hash` must be the hash of `set`.
+   */
+  size_t find(unsigned long long hash, const dependency_set &set) const;
+  size_t add(unsigned long long hash, const dependency_set &set);
+  const dependency_set &get(size_t id) const { return sets_[id]; }
+  size_t size() const { return sets_.size(); }
+
+private:
+  std::vector<dependency_set> sets_;
+  std::unordered_multimap<unsigned long long, size_t> ids_by_hash_;
+};
+
+} // namespace update_log
+} // namespace upd
@@ -0,0 +1,126 @@
+#include "ent_table.h"
+#include "../xxhash.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace upd {
+namespace update_log {
+
+constexpr size_t ent_table::no_id;
+
+size_t ent_table::ent_hash::operator()(const ent &target) const {
+  return XXH64(target.name, target.name_size, target.parent_id);
+}
+
+bool ent_table::ent_equal::operator()(const ent &left,
+                                      const ent &right) const {
+  return left.parent_id == right.parent_id &&
+         left.name_size == right.name_size &&
+         std::memcmp(left.name, right.name, left.name_size) == 0;
+}
+
+size_t ent_table::find(size_t parent_id, const char *name,
+                       size_t name_size) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return find_(parent_id, name, name_size);
+}
+
+size_t ent_table::find_(size_t parent_id, const char *name,
+                        size_t name_size) const {
+  auto iter = ids_.find({parent_id, name, name_size});
+  if (iter == ids_.end()) return no_id;
+  return iter->second;
+}
+
+size_t ent_table::find_path(const std::string &local_path) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t ent_id = no_id;
+  size_t start_ix = 0;
+  while (true) {
+    auto end_ix = local_path.find('/', start_ix);
+    auto name_end_ix =
+        end_ix == std::string::npos ? local_path.size() : end_ix;
+    auto name_size = name_end_ix - start_ix;
+    ent_id = find_(ent_id, local_path.data() + start_ix, name_size);
+    if (ent_id == no_id || end_ix == std::string::npos) return ent_id;
+    start_ix = end_ix + 1;
+  }
+}
+
+size_t ent_table::add_stored(size_t parent_id, const char *name,
+                             size_t name_size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return add_stored_(parent_id, name, name_size);
+}
+
+size_t ent_table::add_stored_(size_t parent_id, const char *name,
+                              size_t name_size) {
+  if (parent_id != no_id && parent_id >= ents_.size()) {
+    throw std::runtime_error("invalid parent entity");
+  }
+  auto id = ents_.size();
+  ents_.push_back({parent_id, name, name_size});
+  ids_.emplace(ents_.back(), id);
+  return id;
+}
+
+size_t ent_table::add(size_t parent_id, const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return add_(parent_id, name);
+}
+
+size_t ent_table::add_(size_t parent_id, const std::string &name) {
+  owned_names_.push_back(name);
+  auto const &owned_name = owned_names_.back();
+  return add_stored_(parent_id, owned_name.data(), owned_name.size());
+}
+
+size_t ent_table::add_path(const std::string &local_path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t ent_id = no_id;
+  size_t start_ix = 0;
+  while (true) {
+    auto end_ix = local_path.find('/', start_ix);
+    auto name_end_ix =
+        end_ix == std::string::npos ? local_path.size() : end_ix;
+    auto name_size = name_end_ix - start_ix;
+    auto child_id = find_(ent_id, local_path.data() + start_ix, name_size);
+    if (child_id == no_id) {
+      child_id = add_(ent_id, local_path.substr(start_ix, name_size));
+    }
+    ent_id = child_id;
+    if (end_ix == std::string::npos) return ent_id;
+    start_ix = end_ix + 1;
+  }
+}
+
+std::string ent_table::get_path(size_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto const *target = &ents_.at(id);
+  std::string path(target->name, target->name_size);
+  while (target->parent_id != no_id) {
+    target = &ents_[target->parent_id];
+    path.insert(0, 1, '/');
+    path.insert(0, target->name, target->name_size);
+  }
+  return path;
+}
+
+size_t ent_table::get_parent_id(size_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ents_.at(id).parent_id;
+}
+
+std::string ent_table::get_name(size_t id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto const &target = ents_.at(id);
+  return std::string(target.name, target.name_size);
+}
+
+size_t ent_table::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ents_.size();
+}
+
+} // namespace update_log
+} // namespace upd
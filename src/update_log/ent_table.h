@@ -0,0 +1,84 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace upd {
+namespace update_log {
+
+/**
+ * The entities of the update log. An entity is a file or directory, that is
+ * named relative to its parent entity, if any. Ids are assigned in order,
+ * starting from zero. Names are not copied when they come from a log file
+ * mapped in memory: the table keeps the mapping alive instead.
+ *
+ * Update records refer to files by their entity id, so that a path shared by
+ * many records, such as a common header, is only stored once. The table is
+ * shared by the threads that check and update targets, so it is safe to use
+ * from several threads at once.
+ */
+struct ent_table {
+  static constexpr size_t no_id = ~static_cast<size_t>(0);
+
+  ent_table() {}
+  ent_table(std::shared_ptr<const void> storage) : storage_(storage) {}
+  ent_table(ent_table &) = delete;
+
+  /**
+   * Returns the id of the entity with that parent and name, or `no_id` if
+   * there is none. The parent is `no_id` for root entities.
+   */
+  size_t find(size_t parent_id, const char *name, size_t name_size) const;
+  /**
+   * Returns the id of the entity for a local path such as "foo/bar.h", or
+   * `no_id` if any part of it is unknown.
+   */
+  size_t find_path(const std::string &local_path) const;
+  /**
+   * Add an entity whose name is part of the storage the table was created
+   * with, so it isn't copied.
+   */
+  size_t add_stored(size_t parent_id, const char *name, size_t name_size);
+  size_t add(size_t parent_id, const std::string &name);
+  /**
+   * Returns the id of the entity for a local path, adding the entities that
+   * are missing, if any.
+   */
+  size_t add_path(const std::string &local_path);
+  std::string get_path(size_t id) const;
+  size_t get_parent_id(size_t id) const;
+  std::string get_name(size_t id) const;
+  size_t size() const;
+
+private:
+  struct ent {
+    size_t parent_id;
+    const char *name;
+    size_t name_size;
+  };
+
+  struct ent_hash {
+    size_t operator()(const ent &target) const;
+  };
+
+  struct ent_equal {
+    bool operator()(const ent &left, const ent &right) const;
+  };
+
+  size_t find_(size_t parent_id, const char *name, size_t name_size) const;
+  size_t add_stored_(size_t parent_id, const char *name, size_t name_size);
+  size_t add_(size_t parent_id, const std::string &name);
+
+  mutable std::mutex mutex_;
+  std::shared_ptr<const void> storage_;
+  std::vector<ent> ents_;
+  std::unordered_map<ent, size_t, ent_hash, ent_equal> ids_;
+  std::deque<std::string> owned_names_;
+};
+
+} // namespace update_log
+} // namespace upd
@@ -1,79 +1,159 @@
 #include "read.h"
-#include "read_fd_forward.h"
 #include "read_impl.h"
 #include <algorithm>
+#include <cstring>
 
 namespace upd {
 namespace update_log {
 
-template <typename Read>
-void read_ent_path(const string_vector &ent_paths, Read &read,
-                   std::string &value) {
-  size_t ent_id;
-  read_var_size_t(read, ent_id);
-  value = ent_paths.at(ent_id);
-}
-
-template <typename Read>
-bool read_update_record(const string_vector &ent_paths, Read &&read,
-                        std::string &file_name, file_record &record) {
+file_record read_update_record(const ent_table &ents,
+                               const dependency_set_table &dep_sets,
+                               const mapped_record &target) {
+  read_memory read(target.data, target.size);
+  auto ent_count = ents.size();
+  file_record record;
+  size_t file_ent_id;
   read_scalar(read, record.imprint);
   read_scalar(read, record.hash);
-  read_ent_path(ent_paths, read, file_name);
-  size_t dep_count;
-  read_var_size_t(read, dep_count);
-  record.dependency_local_paths.resize(dep_count);
-  for (size_t i = 0; i < dep_count; ++i)
-    read_ent_path(ent_paths, read, record.dependency_local_paths[i]);
-  return true;
+  read_var_size_t(read, file_ent_id);
+  size_t dep_set_id;
+  read_var_size_t(read, dep_set_id);
+  if (dep_set_id >= dep_sets.size())
+    throw std::runtime_error("invalid dependency set");
+  record.dependency_ent_ids = dep_sets.get(dep_set_id);
+  read_file_stat(read, record.stat);
+  size_t fingerprint_count;
+  read_var_size_t(read, fingerprint_count);
+  for (size_t i = 0; i < fingerprint_count; ++i) {
+    size_t ent_id;
+    read_ent_id(ent_count, read, ent_id);
+    auto &fingerprint = record.input_fingerprints[ent_id];
+    read_scalar(read, fingerprint.hash);
+    read_file_stat(read, fingerprint.stat);
+  }
+  size_t duration_ms;
+  read_var_size_t(read, duration_ms);
+  record.duration_ms = duration_ms;
+  return record;
 }
 
-template <typename Read>
-std::pair<size_t, std::string> read_entity_name_record(Read &&read) {
-  std::pair<size_t, std::string> record;
-  read_var_size_t(read, record.first);
-  read_string(read, record.second);
-  return record;
+bool try_read_update_record(const ent_table &ents,
+                            const dependency_set_table &dep_sets,
+                            const mapped_record &target, file_record &record) {
+  try {
+    record = read_update_record(ents, dep_sets, target);
+    return true;
+  } catch (const unexpected_end_of_file_error &) {
+  } catch (const std::runtime_error &) {
+  }
+  return false;
 }
 
 /**
- * `Read` is a function such as `size_t()(char* buffer, size_t count)` that
- * reads `count` bytes from some data source into the `buffer`, and return the
- * number of bytes actually read (ex. if we reached the end of a file).
+ * Index a single record. For update records, we only read the entity of the
+ * updated file, the rest is decoded later if needed.
  */
-template <typename Read> cache_file_data read(Read &&read) {
-  cache_file_data rs;
+static void index_record(cache_file_data &rs, const char *data, size_t size) {
+  read_memory read(data, size);
   record_type type;
+  read_scalar(read, type);
+  if (type == record_type::file_update) {
+    size_t ent_id;
+    auto hashes_size = sizeof(file_record::imprint) + sizeof(file_record::hash);
+    if (read.skip(hashes_size) < hashes_size)
+      throw unexpected_end_of_file_error();
+    read_var_size_t(read, ent_id);
+    if (ent_id >= rs.ents->size()) throw std::runtime_error("invalid entity");
+    rs.records[ent_id] = {data + sizeof(type), size - sizeof(type)};
+    ++rs.record_count;
+    return;
+  }
+  if (type == record_type::dependency_set) {
+    unsigned long long hash;
+    size_t dep_count;
+    read_scalar(read, hash);
+    read_var_size_t(read, dep_count);
+    if (dep_count > size) throw unexpected_end_of_file_error();
+    std::vector<size_t> ent_ids(dep_count);
+    for (size_t i = 0; i < dep_count; ++i)
+      read_ent_id(rs.ents->size(), read, ent_ids[i]);
+    rs.dep_sets->add(hash, dependency_set(std::move(ent_ids)));
+    return;
+  }
+  if (type == record_type::root_entity_name) {
+    const char *name;
+    size_t name_size;
+    read_stored_string(read, name, name_size);
+    rs.ents->add_stored(ent_table::no_id, name, name_size);
+    return;
+  }
+  if (type == record_type::entity_name) {
+    size_t parent_id;
+    const char *name;
+    size_t name_size;
+    read_var_size_t(read, parent_id);
+    if (parent_id >= rs.ents->size())
+      throw std::runtime_error("invalid entity");
+    read_stored_string(read, name, name_size);
+    rs.ents->add_stored(parent_id, name, name_size);
+    return;
+  }
+  throw std::runtime_error("wrong record type: " +
+                           std::to_string(static_cast<unsigned char>(type)));
+}
+
+/**
+ * A record can be inconsistent even though its checksum is valid, for example
+ * if the log was written by a buggy version, or was modified by hand. We treat
+ * it the same way as a torn frame.
+ */
+static bool try_index_record(cache_file_data &rs, const char *data,
+                             size_t size) {
+  try {
+    index_record(rs, data, size);
+    return true;
+  } catch (const unexpected_end_of_file_error &) {
+  } catch (const std::runtime_error &) {
+  }
+  return false;
+}
+
+/**
+ * Largest size we accept for a single record. Anything bigger is certainly
+ * a corrupted frame header.
+ */
+static constexpr uint32_t MAX_FRAME_SIZE = 1 << 28;
+
+bool read_frame(read_memory &read, const char *&payload, uint32_t &size) {
+  uint32_t checksum;
+  char header[FRAME_HEADER_SIZE];
+  if (read(header, FRAME_HEADER_SIZE) < FRAME_HEADER_SIZE) return false;
+  std::memcpy(&size, header, sizeof(size));
+  std::memcpy(&checksum, header + sizeof(size), sizeof(checksum));
+  if (size > MAX_FRAME_SIZE) return false;
+  payload = read.data();
+  if (read.skip(size) < size) return false;
+  return get_frame_checksum(payload, size) == checksum;
+}
+
+cache_file_data read_mapped(std::shared_ptr<const io::mapped_file> file) {
+  cache_file_data rs;
+  rs.ents = std::make_shared<ent_table>(file);
+  rs.dep_sets = std::make_shared<dependency_set_table>();
+  rs.record_count = 0;
+  read_memory read(file->data(), file->size());
   char version;
-  read_scalar(read, version);
-  if (version != VERSION) throw version_mismatch_error();
-  while (try_read_scalar(read, type)) {
-    if (type == record_type::file_update) {
-      file_record record;
-      std::string file_path;
-      read_update_record(rs.ent_paths, read, file_path, record);
-      rs.records[file_path] = record;
-      continue;
-    }
-    if (type == record_type::root_entity_name) {
-      std::string name;
-      read_string(read, name);
-      rs.ent_paths.push_back(name);
-      continue;
-    }
-    if (type == record_type::entity_name) {
-      auto record = read_entity_name_record(read);
-      auto parent_path = rs.ent_paths.at(record.first) + "/";
-      rs.ent_paths.push_back(parent_path + record.second);
-      continue;
-    }
-    throw std::runtime_error("wrong record type: " +
-                             std::to_string(static_cast<unsigned char>(type)));
+  if (!try_read_scalar(read, version) || version != VERSION)
+    throw version_mismatch_error();
+  rs.valid_size = sizeof(version);
+  const char *payload;
+  uint32_t size;
+  while (read_frame(read, payload, size) &&
+         try_index_record(rs, payload, size)) {
+    rs.valid_size += FRAME_HEADER_SIZE + size;
   }
   return rs;
 }
 
-cache_file_data read_fd(int fd) { return read(read_fd_forward<4096>(fd)); }
-
 } // namespace update_log
 } // namespace upd
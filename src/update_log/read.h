@@ -22,10 +22,35 @@ struct unexpected_end_of_file_error {};
 enum class record_type : unsigned char {
   root_entity_name = 'R',
   entity_name = 'E',
+  dependency_set = 'D',
   file_update = 'U',
 };
 
-cache_file_data read_fd(int fd);
+/**
+ * Index the records of a log file mapped in memory. Update records are not
+ * decoded at that point, see `read_update_record`, but dependency sets are, as
+ * they are shared by many update records.
+ *
+ * A log that was only partially written, or that is corrupted, is not an
+ * error: we keep the records up to the first bad one, and ignore the rest. An
+ * empty log, or one of another version, throws `version_mismatch_error`.
+ */
+cache_file_data read_mapped(std::shared_ptr<const io::mapped_file> file);
+
+/**
+ * Decode an update record that was indexed by `read_mapped`.
+ */
+file_record read_update_record(const ent_table &ents,
+                               const dependency_set_table &dep_sets,
+                               const mapped_record &target);
+
+/**
+ * Same as `read_update_record`, but returns `false` if the record turns out to
+ * be corrupted, in which case the file is considered as never updated.
+ */
+bool try_read_update_record(const ent_table &ents,
+                            const dependency_set_table &dep_sets,
+                            const mapped_record &target, file_record &record);
 
 } // namespace update_log
 } // namespace upd
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "read.h"
+#include <algorithm>
+#include <cstring>
 
 namespace upd {
 namespace update_log {
@@ -21,20 +23,49 @@ void read_scalar(Read &&read, Scalar &value) {
     throw unexpected_end_of_file_error();
 }
 
+/**
+ * Read a number encoded 7 bits at a time, with the highest bit of each byte
+ * telling if more bytes follow. That's up to 10 bytes for 64-bit values.
+ */
 template <typename Read> void read_var_size_t(Read &&read, size_t &value) {
   value = 0;
   unsigned char next;
   size_t shift = 0;
-  size_t count = 5;
   do {
+    if (shift >= sizeof(value) * 8)
+      throw std::runtime_error("invalid var size_t");
     read_scalar(read, next);
-    value |= (next & 127) << shift;
+    value |= static_cast<size_t>(next & 127) << shift;
     shift += 7;
-    --count;
-  } while ((next & 128) > 0 && count > 0);
-  if (count == 0) throw std::runtime_error("invalid var size_t");
+  } while ((next & 128) > 0);
 }
 
+/**
+ * Read function for data that is already in memory.
+ */
+struct read_memory {
+  read_memory(const char *data, size_t size)
+      : next_(data), end_(data + size) {}
+  size_t operator()(char *buf, size_t count) {
+    count = skip(count);
+    std::memcpy(buf, next_ - count, count);
+    return count;
+  }
+  /**
+   * Move ahead without copying anything, and return by how much.
+   */
+  size_t skip(size_t count) {
+    count = std::min(count, static_cast<size_t>(end_ - next_));
+    next_ += count;
+    return count;
+  }
+  const char *data() const { return next_; }
+
+private:
+  const char *next_;
+  const char *end_;
+};
+
 template <typename Read> void read_string(Read &&read, std::string &value) {
   size_t size;
   read_var_size_t(read, size);
@@ -42,5 +73,39 @@ template <typename Read> void read_string(Read &&read, std::string &value) {
   if (read(&value[0], size) < size) throw unexpected_end_of_file_error();
 }
 
+/**
+ * Read a string that is already in memory without copying it.
+ */
+inline void read_stored_string(read_memory &read, const char *&value,
+                               size_t &size) {
+  read_var_size_t(read, size);
+  value = read.data();
+  if (read.skip(size) < size) throw unexpected_end_of_file_error();
+}
+
+/**
+ * Read the id of an entity, that must be one of the `ent_count` known so far.
+ */
+template <typename Read>
+void read_ent_id(size_t ent_count, Read &read, size_t &ent_id) {
+  read_var_size_t(read, ent_id);
+  if (ent_id >= ent_count) throw std::runtime_error("invalid entity");
+}
+
+template <typename Read> void read_file_stat(Read &read, file_stat &stat) {
+  read_scalar(read, stat.dev);
+  read_scalar(read, stat.ino);
+  read_scalar(read, stat.size);
+  read_scalar(read, stat.mtime_ns);
+  read_scalar(read, stat.ctime_ns);
+}
+
+/**
+ * Get the next frame of the log, that contains a single record. Returns
+ * `false` at the end of the log, or if the frame was only partially written or
+ * is corrupted, in which case we ignore it and everything after it.
+ */
+bool read_frame(read_memory &read, const char *&payload, uint32_t &size);
+
 } // namespace update_log
 } // namespace upd
@@ -1,13 +1,17 @@
 #include "recorder.h"
 #include "../io/io.h"
+#include "../xxhash.h"
 #include "read.h"
 #include "write_impl.h"
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <fcntl.h>
 #include <iomanip>
 #include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <utility>
 
 namespace upd {
@@ -17,82 +21,218 @@ static constexpr int WRITE_FLAGS =
     /* no reads are done when recording */
     O_WRONLY |
     /* before each write we ensure we're at the end of the file */
-    O_APPEND |
-    /* ensure each write is flushed before we continue so as to
-       be crash-resilient */
-    O_SYNC;
+    O_APPEND;
 
 static constexpr int MODE = S_IRUSR | S_IWUSR;
 
-recorder::recorder(const std::string &file_path)
-    : fd_(io::open(file_path, O_CREAT | O_TRUNC | WRITE_FLAGS, MODE)) {
-  io::write(fd_, &VERSION, 1);
+/**
+ * A batch is written as soon as it reaches that size, or once its oldest
+ * record has been waiting for that long, whichever comes first.
+ */
+static constexpr size_t BATCH_SIZE = 1 << 16;
+static constexpr std::chrono::milliseconds BATCH_DELAY(20);
+
+/**
+ * Records accumulate in `batch` until the writer thread takes it, writes it
+ * with a single call, and flushes it. If writing fails, the error is reported
+ * by the next call to `append` or `close`.
+ */
+struct recorder::journal {
+  journal(io::file_descriptor &&fd_)
+      : fd(std::move(fd_)), closing(false), writer(&journal::run, this) {}
+  void run();
+  void append(const std::vector<char> &data);
+  void close();
+
+  io::file_descriptor fd;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<char> batch;
+  std::chrono::steady_clock::time_point batch_start;
+  bool closing;
+  std::exception_ptr eptr;
+  std::thread writer;
+};
+
+void recorder::journal::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    if (batch.empty()) {
+      if (closing) return;
+      cv.wait(lock);
+      continue;
+    }
+    auto deadline = batch_start + BATCH_DELAY;
+    if (!closing && batch.size() < BATCH_SIZE &&
+        std::chrono::steady_clock::now() < deadline) {
+      cv.wait_until(lock, deadline);
+      continue;
+    }
+    std::vector<char> data;
+    data.swap(batch);
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+      for (size_t i = 0; i < data.size();) {
+        i += io::write(fd, data.data() + i, data.size() - i);
+      }
+      io::fdatasync(fd);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    lock.lock();
+    if (error) {
+      eptr = error;
+      batch.clear();
+      return;
+    }
+  }
+}
+
+void recorder::journal::append(const std::vector<char> &data) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (eptr) std::rethrow_exception(eptr);
+  if (batch.empty()) batch_start = std::chrono::steady_clock::now();
+  batch.insert(batch.end(), data.begin(), data.end());
+  if (batch.size() >= BATCH_SIZE) cv.notify_all();
 }
 
-static ent_ids_by_path build_ent_index(const string_vector &ent_paths) {
-  ent_ids_by_path index;
-  for (size_t i = 0; i < ent_paths.size(); ++i) {
-    index[ent_paths[i]] = i;
+void recorder::journal::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closing = true;
+    cv.notify_all();
   }
-  return index;
+  writer.join();
+  fd.close();
+  if (eptr) std::rethrow_exception(eptr);
 }
 
-recorder::recorder(const std::string &file_path, const string_vector &ent_paths)
-    : fd_(io::open(file_path, WRITE_FLAGS, MODE)),
-      ent_ids_by_path_(build_ent_index(ent_paths)) {}
+recorder::recorder(const std::string &file_path,
+                   std::shared_ptr<ent_table> ents,
+                   std::shared_ptr<dependency_set_table> dep_sets)
+    : journal_(new journal(
+          io::open(file_path, O_CREAT | O_TRUNC | WRITE_FLAGS, MODE))),
+      encoder_(ents, dep_sets) {
+  journal_->append({VERSION});
+}
 
-void recorder::record(const std::string &local_file_path,
-                      const file_record &record) {
-  std::vector<char> buf;
-  write_scalar(buf, record_type::file_update);
-  write_scalar(buf, record.imprint);
-  write_scalar(buf, record.hash);
-  write_var_size_t(buf, get_path_id_(local_file_path));
-  write_var_size_t(buf, record.dependency_local_paths.size());
-  for (const auto &dep_path : record.dependency_local_paths) {
-    write_var_size_t(buf, get_path_id_(dep_path));
+uint32_t get_frame_checksum(const char *payload, size_t size) {
+  return XXH32(payload, size, 0);
+}
+
+static void write_frame(std::vector<char> &buf,
+                        const std::vector<char> &payload) {
+  write_scalar(buf, static_cast<uint32_t>(payload.size()));
+  write_scalar(buf, get_frame_checksum(payload.data(), payload.size()));
+  buf.insert(buf.end(), payload.begin(), payload.end());
+}
+
+static void write_file_stat(std::vector<char> &buf, const file_stat &stat) {
+  write_scalar(buf, stat.dev);
+  write_scalar(buf, stat.ino);
+  write_scalar(buf, stat.size);
+  write_scalar(buf, stat.mtime_ns);
+  write_scalar(buf, stat.ctime_ns);
+}
+
+void record_encoder::encode(std::vector<char> &buf,
+                            const std::string &local_file_path,
+                            const file_record &record) {
+  auto file_ent_id = ents_->add_path(local_file_path);
+  encode_ent_names_(buf);
+  auto dep_set_id = get_dep_set_id_(buf, record.dependency_ent_ids);
+  std::vector<char> payload;
+  write_scalar(payload, record_type::file_update);
+  write_scalar(payload, record.imprint);
+  write_scalar(payload, record.hash);
+  write_var_size_t(payload, file_ent_id);
+  write_var_size_t(payload, dep_set_id);
+  write_file_stat(payload, record.stat);
+  write_var_size_t(payload, record.input_fingerprints.size());
+  for (const auto &entry : record.input_fingerprints) {
+    write_var_size_t(payload, entry.first);
+    write_scalar(payload, entry.second.hash);
+    write_file_stat(payload, entry.second.stat);
   }
-  io::write(fd_, buf.data(), buf.size());
+  write_var_size_t(payload, record.duration_ms);
+  write_frame(buf, payload);
 }
 
-static const size_t no_id = ~0;
-
-size_t recorder::get_path_id_(const std::string &file_path) {
-  auto ix = file_path.find('/');
-  size_t parent_ent_id = no_id;
-  size_t parent_ix = std::string::npos;
-  do {
-    auto path_part = file_path.substr(0, ix);
-    auto idit = ent_ids_by_path_.find(path_part);
-    if (idit != ent_ids_by_path_.end()) {
-      parent_ent_id = idit->second;
+/**
+ * Entities are named in the order of their ids, so that a parent is always
+ * named before its children, and the reader assigns the same ids again.
+ */
+void record_encoder::encode_ent_names_(std::vector<char> &buf) {
+  auto ent_count = ents_->size();
+  for (; named_ent_count_ < ent_count; ++named_ent_count_) {
+    auto parent_ent_id = ents_->get_parent_id(named_ent_count_);
+    std::vector<char> payload;
+    if (parent_ent_id == ent_table::no_id) {
+      write_scalar(payload, record_type::root_entity_name);
     } else {
-      auto ent_id = ent_ids_by_path_.size();
-      ent_ids_by_path_.emplace(path_part, ent_id);
-      auto ent_name = file_path.substr(parent_ix + 1, ix - parent_ix - 1);
-      record_ent_name_(parent_ent_id, ent_name);
-      parent_ent_id = ent_id;
+      write_scalar(payload, record_type::entity_name);
+      write_var_size_t(payload, parent_ent_id);
     }
-    parent_ix = ix;
-    ix = file_path.find('/', ix + 1);
-  } while (parent_ix != std::string::npos);
-  return parent_ent_id;
+    write_string(payload, ents_->get_name(named_ent_count_));
+    write_frame(buf, payload);
+  }
 }
 
-void recorder::record_ent_name_(size_t parent_ent_id, const std::string &name) {
-  std::vector<char> buf;
-  if (parent_ent_id == no_id) {
-    write_scalar(buf, record_type::root_entity_name);
-    write_string(buf, name);
-  } else {
-    write_scalar(buf, record_type::entity_name);
-    write_var_size_t(buf, parent_ent_id);
-    write_string(buf, name);
+size_t record_encoder::get_dep_set_id_(std::vector<char> &buf,
+                                       const dependency_set &deps) {
+  auto hash = dependency_set_table::hash(deps);
+  auto dep_set_id = dep_sets_->find(hash, deps);
+  if (dep_set_id != dependency_set_table::no_id) return dep_set_id;
+  std::vector<char> payload;
+  write_scalar(payload, record_type::dependency_set);
+  write_scalar(payload, hash);
+  write_var_size_t(payload, deps.size());
+  for (auto dep_ent_id : deps) {
+    write_var_size_t(payload, dep_ent_id);
   }
-  io::write(fd_, buf.data(), buf.size());
+  write_frame(buf, payload);
+  return dep_sets_->add(hash, deps);
 }
 
-void recorder::close() { fd_.close(); }
+static io::file_descriptor open_for_append(const std::string &file_path,
+                                           size_t valid_size) {
+  io::file_descriptor fd = io::open(file_path, WRITE_FLAGS, MODE);
+  io::ftruncate(fd, valid_size);
+  return fd;
+}
+
+recorder::recorder(const std::string &file_path,
+                   std::shared_ptr<ent_table> ents,
+                   std::shared_ptr<dependency_set_table> dep_sets,
+                   size_t valid_size)
+    : journal_(new journal(open_for_append(file_path, valid_size))),
+      encoder_(ents, dep_sets) {}
+
+recorder::recorder(recorder &&) = default;
+recorder &recorder::operator=(recorder &&) = default;
+
+recorder::~recorder() {
+  if (!journal_) return;
+  try {
+    journal_->close();
+  } catch (...) {
+    // Nothing we can do at that point, the log will be missing the latest
+    // records.
+  }
+}
+
+void recorder::record(const std::string &local_file_path,
+                      const file_record &record) {
+  std::vector<char> buf;
+  encoder_.encode(buf, local_file_path, record);
+  journal_->append(buf);
+}
+
+void recorder::close() {
+  std::unique_ptr<journal> target = std::move(journal_);
+  target->close();
+}
 
 } // namespace update_log
 } // namespace upd
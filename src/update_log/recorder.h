@@ -2,6 +2,9 @@
 
 #include "../../gen/src/update_log/file_record.h"
 #include "../io/file_descriptor.h"
+#include "dependency_set.h"
+#include "ent_table.h"
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -9,10 +12,45 @@
 namespace upd {
 namespace update_log {
 
-constexpr char VERSION = 4;
+constexpr char VERSION = 9;
 
-typedef std::unordered_map<std::string, uint16_t> ent_ids_by_path;
-typedef std::vector<std::string> string_vector;
+/**
+ * Each record is preceded by its size and checksum, both 32-bit.
+ */
+constexpr size_t FRAME_HEADER_SIZE = 8;
+uint32_t get_frame_checksum(const char *payload, size_t size);
+
+/**
+ * Serialize records in the update log format. Paths are made of entities that
+ * are only named once for the whole log. Records refer to entities of the
+ * table the encoder is created with, and the encoder names the ones that were
+ * added to it since the last record, if any, before the record itself.
+ * Likewise, each distinct set of dependencies is only defined once, and
+ * records refer to it by id.
+ */
+struct record_encoder {
+  /**
+   * Start from the entities and dependency sets of an existing log, that are
+   * all defined already, if any.
+   */
+  record_encoder(std::shared_ptr<ent_table> ents,
+                 std::shared_ptr<dependency_set_table> dep_sets)
+      : ents_(ents), named_ent_count_(ents->size()), dep_sets_(dep_sets) {}
+  /**
+   * Append the frames of the record, and of any new entity, at the end of
+   * `buf`.
+   */
+  void encode(std::vector<char> &buf, const std::string &local_file_path,
+              const file_record &record);
+
+private:
+  void encode_ent_names_(std::vector<char> &buf);
+  size_t get_dep_set_id_(std::vector<char> &buf, const dependency_set &deps);
+
+  std::shared_ptr<ent_table> ents_;
+  size_t named_ent_count_;
+  std::shared_ptr<dependency_set_table> dep_sets_;
+};
 
 /**
  * Allow us to write to the update log as we go (normally ".upd/log"). We append
@@ -20,19 +58,39 @@ typedef std::vector<std::string> string_vector;
  * allows us to support crashes out-of-the-box, with no specific exit code.
  * For example, if we update file A, but then the process receive SIGINT, or it
  * throws an exception, we already persisted the information about A.
+ *
+ * Flushing each record to disk separately would be very slow. Instead, records
+ * are appended to a batch that a dedicated thread writes and flushes in one go,
+ * once it is big or old enough. Each record is framed with its size and a
+ * checksum, so that a batch only partially written before a crash gets ignored
+ * when reading the log back. At most the last batch is lost in a crash.
  */
 struct recorder {
-  recorder(const std::string &file_path);
-  recorder(const std::string &file_path, const string_vector &ent_paths);
+  /**
+   * Start a new log, that names entities as they're added to `ents`.
+   */
+  recorder(const std::string &file_path, std::shared_ptr<ent_table> ents,
+           std::shared_ptr<dependency_set_table> dep_sets);
+  /**
+   * Append to an existing log, of which only the first `valid_size` bytes
+   * contain valid records. The rest, if any, is truncated.
+   */
+  recorder(const std::string &file_path, std::shared_ptr<ent_table> ents,
+           std::shared_ptr<dependency_set_table> dep_sets, size_t valid_size);
+  recorder(recorder &&);
+  recorder &operator=(recorder &&);
+  ~recorder();
   void record(const std::string &local_file_path, const file_record &record);
+  /**
+   * Write and flush the records that remain in the batch, and close the file.
+   */
   void close();
 
 private:
-  size_t get_path_id_(const std::string &file_path);
-  void record_ent_name_(size_t parent_ent_id, const std::string &name);
+  struct journal;
 
-  io::file_descriptor fd_;
-  ent_ids_by_path ent_ids_by_path_;
+  std::unique_ptr<journal> journal_;
+  record_encoder encoder_;
 };
 
 } // namespace update_log
@@ -0,0 +1,163 @@
+#include "upgrade.h"
+#include "../io/io.h"
+#include "read_impl.h"
+#include <fcntl.h>
+
+namespace upd {
+namespace update_log {
+
+/**
+ * How each previous version differs from the current one. Version 4 didn't
+ * have the stat data and the fingerprints of the files. Version 6 added the
+ * frames, and version 7 allowed larger entity ids, with the same encoding.
+ * Version 8 added the dependency sets. None had the durations of commands.
+ */
+struct legacy_format {
+  bool has_fingerprints;
+  bool has_frames;
+  bool has_dependency_sets;
+};
+
+static legacy_format get_legacy_format(char version) {
+  return {version >= 5, version >= 6, version >= 8};
+}
+
+/**
+ * The entities and dependency sets defined so far by a legacy log.
+ */
+struct legacy_log_state {
+  ent_table &ents;
+  std::vector<dependency_set> dep_sets;
+};
+
+template <typename Read>
+static void read_legacy_ent_ids(Read &read, const ent_table &ents,
+                                std::vector<size_t> &ent_ids) {
+  size_t count;
+  read_var_size_t(read, count);
+  for (size_t i = 0; i < count; ++i) {
+    size_t ent_id;
+    read_ent_id(ents.size(), read, ent_id);
+    ent_ids.push_back(ent_id);
+  }
+}
+
+template <typename Read>
+static void read_legacy_record(Read &read, const legacy_format &format,
+                               legacy_log_state &state,
+                               records_by_file &records) {
+  auto &ents = state.ents;
+  record_type type;
+  read_scalar(read, type);
+  if (type == record_type::file_update) {
+    file_record record;
+    size_t file_ent_id;
+    read_scalar(read, record.imprint);
+    read_scalar(read, record.hash);
+    read_ent_id(ents.size(), read, file_ent_id);
+    if (format.has_dependency_sets) {
+      size_t dep_set_id;
+      read_var_size_t(read, dep_set_id);
+      if (dep_set_id >= state.dep_sets.size())
+        throw std::runtime_error("invalid dependency set");
+      record.dependency_ent_ids = state.dep_sets[dep_set_id];
+    } else {
+      std::vector<size_t> dep_ent_ids;
+      read_legacy_ent_ids(read, ents, dep_ent_ids);
+      record.dependency_ent_ids = std::move(dep_ent_ids);
+    }
+    record.stat = {0, 0, 0, 0, 0};
+    if (format.has_fingerprints) {
+      size_t fingerprint_count;
+      read_file_stat(read, record.stat);
+      read_var_size_t(read, fingerprint_count);
+      for (size_t i = 0; i < fingerprint_count; ++i) {
+        size_t ent_id;
+        read_ent_id(ents.size(), read, ent_id);
+        auto &fingerprint = record.input_fingerprints[ent_id];
+        read_scalar(read, fingerprint.hash);
+        read_file_stat(read, fingerprint.stat);
+      }
+    }
+    record.duration_ms = 0;
+    records[ents.get_path(file_ent_id)] = std::move(record);
+    return;
+  }
+  if (format.has_dependency_sets && type == record_type::dependency_set) {
+    unsigned long long hash;
+    std::vector<size_t> dep_ent_ids;
+    read_scalar(read, hash);
+    read_legacy_ent_ids(read, ents, dep_ent_ids);
+    state.dep_sets.push_back(std::move(dep_ent_ids));
+    return;
+  }
+  size_t parent_id = ent_table::no_id;
+  if (type == record_type::entity_name) {
+    read_ent_id(ents.size(), read, parent_id);
+  } else if (type != record_type::root_entity_name) {
+    throw std::runtime_error("wrong record type: " +
+                             std::to_string(static_cast<unsigned char>(type)));
+  }
+  const char *name;
+  size_t name_size;
+  read_stored_string(read, name, name_size);
+  ents.add(parent_id, std::string(name, name_size));
+}
+
+template <typename Read>
+static bool try_read_legacy_record(Read &read, const legacy_format &format,
+                                   legacy_log_state &state,
+                                   records_by_file &records) {
+  try {
+    read_legacy_record(read, format, state, records);
+    return true;
+  } catch (const unexpected_end_of_file_error &) {
+  } catch (const std::runtime_error &) {
+  }
+  return false;
+}
+
+records_by_file read_legacy_log(const io::mapped_file &file, char version,
+                                ent_table &ents) {
+  auto format = get_legacy_format(version);
+  legacy_log_state state{ents, {}};
+  records_by_file records;
+  read_memory read(file.data() + sizeof(version),
+                   file.size() - sizeof(version));
+  if (!format.has_frames) {
+    auto end = file.data() + file.size();
+    while (read.data() < end) {
+      if (!try_read_legacy_record(read, format, state, records)) break;
+    }
+    return records;
+  }
+  const char *payload;
+  uint32_t size;
+  while (read_frame(read, payload, size)) {
+    read_memory frame_read(payload, size);
+    if (!try_read_legacy_record(frame_read, format, state, records)) break;
+  }
+  return records;
+}
+
+bool upgrade_file(const std::string &file_path,
+                  const std::string &temporary_file_path) {
+  io::file_descriptor fd;
+  try {
+    fd = io::open(file_path, O_RDONLY, 0);
+  } catch (const std::system_error &error) {
+    if (error.code() != std::errc::no_such_file_or_directory) throw;
+    return false;
+  }
+  io::mapped_file file(fd);
+  if (file.size() == 0) return false;
+  char version = file.data()[0];
+  if (version < OLDEST_UPGRADABLE_VERSION || version >= VERSION) return false;
+  ent_table ents;
+  auto records = read_legacy_log(file, version, ents);
+  rewrite_file(file_path, temporary_file_path, records, ents);
+  return true;
+}
+
+} // namespace update_log
+} // namespace upd
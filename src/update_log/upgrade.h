@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../io/utils.h"
+#include "cache.h"
+
+namespace upd {
+namespace update_log {
+
+/**
+ * The oldest version of the update log that we know how to read. Older logs
+ * are discarded, and all the files get updated again.
+ */
+constexpr char OLDEST_UPGRADABLE_VERSION = 4;
+
+/**
+ * Read the records of a log written with a previous version of the format,
+ * starting from the byte after the version. Records refer to entities added
+ * to `ents`. As with the current version, we keep the records up to the first
+ * corrupted one, if any.
+ */
+records_by_file read_legacy_log(const io::mapped_file &file, char version,
+                                ent_table &ents);
+
+/**
+ * If the update log was written with a previous version of the format, rewrite
+ * it in the current version, so that the records it holds carry over. Files
+ * recorded before fingerprints existed get their content hashed once more, but
+ * are not updated again. Returns `true` if the log was upgraded.
+ */
+bool upgrade_file(const std::string &file_path,
+                  const std::string &temporary_file_path);
+
+} // namespace update_log
+} // namespace upd
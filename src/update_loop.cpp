@@ -0,0 +1,225 @@
+#include "update_loop.h"
+#include "cancellation.h"
+#include "io/io.h"
+#include "system/spawn.h"
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+namespace upd {
+
+/**
+ * What each file descriptor of the `epoll` set stands for: the data is the
+ * index of the slot times `FD_KIND_COUNT`, plus the kind.
+ */
+enum fd_kind {
+  exit_fd_kind,
+  stdout_fd_kind,
+  stderr_fd_kind,
+  depfile_fd_kind,
+  tool_fd_kind,
+  FD_KIND_COUNT
+};
+static constexpr unsigned long long WAKE_DATA = ~0ULL;
+
+update_loop::slot::slot()
+    : pid(-1), exited(true), stdout_open(false), stderr_open(false),
+      depfile_open(false), tool(nullptr) {}
+
+update_loop::update_loop(size_t slot_count)
+    : epoll_fd_(io::epoll_create()), wake_pending_(false),
+      slots_(slot_count) {
+  // Kernels older than 5.3 have `epoll` but not pidfds, so we'd rather find
+  // out before starting any process.
+  io::file_descriptor own_pidfd(io::pidfd_open(::getpid()));
+  int wake_fds[2];
+  io::pipe_cloexec(wake_fds);
+  wake_read_fd_ = io::file_descriptor(wake_fds[0]);
+  wake_write_fd_ = io::file_descriptor(wake_fds[1]);
+  io::epoll_add(epoll_fd_, wake_read_fd_, WAKE_DATA);
+  set_cancellation_wake_fd(wake_write_fd_);
+}
+
+/**
+ * Like workers would, we let the processes still running finish, so that
+ * they don't outlive us. As nobody reads their output anymore, we close it
+ * first, otherwise a process blocked writing to it would never terminate.
+ */
+update_loop::~update_loop() {
+  set_cancellation_wake_fd(-1);
+  for (auto &sl : slots_) {
+    if (sl.pid < 0) continue;
+    sl.stdout_fd.close();
+    sl.depfile_fd.close();
+    sl.stderr_pty.reset();
+  }
+  for (auto &sl : slots_) {
+    if (sl.pid < 0) continue;
+    try {
+      system::wait(sl.pid, nullptr);
+    } catch (const std::system_error &) {
+    }
+  }
+}
+
+void update_loop::start(size_t slot_ix, const command_line &target,
+                        bool has_depfile) {
+  auto &sl = slots_.at(slot_ix);
+  if (is_busy_(sl)) throw std::runtime_error("slot is busy");
+  if (!sl.stderr_pty) sl.stderr_pty.reset(new io::pseudoterminal());
+  // Like the workers, we don't let other processes inherit these.
+  int stdout_fds[2];
+  io::pipe_cloexec(stdout_fds);
+  io::file_descriptor stdout_read_fd(stdout_fds[0]);
+  io::file_descriptor stdout_write_fd(stdout_fds[1]);
+  int depfile_fds[2] = {-1, -1};
+  if (has_depfile) io::pipe_cloexec(depfile_fds);
+  io::file_descriptor depfile_read_fd(depfile_fds[0]);
+  io::file_descriptor depfile_write_fd(depfile_fds[1]);
+  io::file_descriptor stderr_fd(
+      io::open(sl.stderr_pty->ptsname(), O_WRONLY | O_NOCTTY | O_CLOEXEC, 0));
+  if (!io::isatty(stderr_fd)) throw std::runtime_error("stderr is not a tty");
+
+  sl.pid = spawn_command_line(
+      target, {stdout_read_fd, stdout_write_fd, sl.stderr_pty->fd(), stderr_fd,
+               depfile_read_fd, depfile_write_fd});
+  sl.exited = false;
+  sl.result = command_line_result();
+  sl.eptr = nullptr;
+  stdout_write_fd.close();
+  stderr_fd.close();
+  depfile_write_fd.close();
+
+  // The process may terminate before we get there, but that's fine, as it
+  // doesn't get reaped until we call `waitpid`.
+  sl.pidfd = io::file_descriptor(io::pidfd_open(sl.pid));
+  sl.stdout_fd = std::move(stdout_read_fd);
+  auto data = slot_ix * FD_KIND_COUNT;
+  io::epoll_add(epoll_fd_, sl.pidfd, data + exit_fd_kind);
+  io::epoll_add(epoll_fd_, sl.stdout_fd, data + stdout_fd_kind);
+  sl.stdout_open = true;
+  io::epoll_add(epoll_fd_, sl.stderr_pty->fd(), data + stderr_fd_kind);
+  sl.stderr_open = true;
+  if (!has_depfile) return;
+  sl.depfile_fd = std::move(depfile_read_fd);
+  io::epoll_add(epoll_fd_, sl.depfile_fd, data + depfile_fd_kind);
+  sl.depfile_open = true;
+}
+
+void update_loop::start_tool(size_t slot_ix, tool_process &tool,
+                             const command_line &target) {
+  auto &sl = slots_.at(slot_ix);
+  if (is_busy_(sl)) throw std::runtime_error("slot is busy");
+  sl.result = command_line_result();
+  sl.eptr = nullptr;
+  sl.tool_reader = tool_response_reader();
+  tool.send(target);
+  io::epoll_add(epoll_fd_, tool.response_fd(),
+                slot_ix * FD_KIND_COUNT + tool_fd_kind);
+  sl.tool = &tool;
+}
+
+bool update_loop::is_busy_(const slot &sl) const {
+  return !sl.exited || sl.stdout_open || sl.stderr_open || sl.depfile_open ||
+         sl.tool != nullptr;
+}
+
+/**
+ * Read what's available, without blocking as `epoll` told us there is
+ * something. Returns `false` once the end is reached. On Linux, reading a
+ * pseudo-terminal fails with `EIO` once its last slave is closed.
+ */
+bool update_loop::read_output_(int fd, std::string &output, bool allow_eio) {
+  char buffer[1 << 12];
+  ssize_t count;
+  try {
+    count = io::read(fd, buffer, sizeof(buffer));
+  } catch (const std::system_error &error) {
+    if (allow_eio && error.code() == std::errc::io_error) return false;
+    throw;
+  }
+  output.append(buffer, count);
+  return count > 0;
+}
+
+/**
+ * Read what's available of the response of a worker. Returns `false` once
+ * the response is complete, or once the worker closed its stdout without
+ * completing it, in which case it must have terminated. An invalid response
+ * is the error of that slot, as a worker would report it.
+ */
+bool update_loop::read_tool_response_(slot &sl) {
+  char buffer[1 << 12];
+  auto count = io::read(sl.tool->response_fd(), buffer, sizeof(buffer));
+  try {
+    if (count > 0 && !sl.tool_reader.push(buffer, count)) return true;
+  } catch (const invalid_tool_response_error &) {
+    sl.eptr = std::current_exception();
+  }
+  io::epoll_remove(epoll_fd_, sl.tool->response_fd());
+  if (!sl.eptr) {
+    sl.result = count > 0 ? std::move(sl.tool_reader.result) : sl.tool->reap();
+  }
+  sl.tool = nullptr;
+  return false;
+}
+
+void update_loop::wait(results &finished, int timeout_ms) {
+  unsigned long long events[64];
+  auto count = io::epoll_wait(epoll_fd_, events, 64, timeout_ms);
+  for (size_t i = 0; i < count; ++i) {
+    if (events[i] == WAKE_DATA) {
+      char c;
+      io::read(wake_read_fd_, &c, 1);
+      wake_pending_ = false;
+      continue;
+    }
+    auto slot_ix = events[i] / FD_KIND_COUNT;
+    auto &sl = slots_[slot_ix];
+    switch (events[i] % FD_KIND_COUNT) {
+    case exit_fd_kind:
+      io::epoll_remove(epoll_fd_, sl.pidfd);
+      sl.pidfd.close();
+      sl.exited = true;
+      break;
+    case stdout_fd_kind:
+      if (read_output_(sl.stdout_fd, sl.result.stdout, false)) continue;
+      io::epoll_remove(epoll_fd_, sl.stdout_fd);
+      sl.stdout_fd.close();
+      sl.stdout_open = false;
+      break;
+    case stderr_fd_kind:
+      if (read_output_(sl.stderr_pty->fd(), sl.result.stderr, true)) continue;
+      io::epoll_remove(epoll_fd_, sl.stderr_pty->fd());
+      sl.stderr_open = false;
+      break;
+    case depfile_fd_kind:
+      if (read_output_(sl.depfile_fd, sl.result.depfile, false)) continue;
+      io::epoll_remove(epoll_fd_, sl.depfile_fd);
+      sl.depfile_fd.close();
+      sl.depfile_open = false;
+      break;
+    case tool_fd_kind:
+      if (read_tool_response_(sl)) continue;
+      break;
+    }
+    if (is_busy_(sl)) continue;
+    // Other processes of its group may still have the output open, so we
+    // only reap the process then, so that its process group stays the same
+    // until that point.
+    if (sl.pid >= 0) {
+      system::wait(sl.pid, &sl.result.status);
+      sl.pid = -1;
+    }
+    finished.push_back({slot_ix, std::move(sl.result), sl.eptr});
+  }
+}
+
+void update_loop::wake() {
+  if (wake_pending_.exchange(true)) return;
+  char c = 0;
+  io::write(wake_write_fd_, &c, 1);
+}
+
+} // namespace upd
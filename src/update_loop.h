@@ -0,0 +1,102 @@
+#pragma once
+
+#include "io/file_descriptor.h"
+#include "io/pseudoterminal.h"
+#include "run_command_line.h"
+#include "tool_process.h"
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace upd {
+
+/**
+ * Runs the processes of update jobs from a single thread, rather than having
+ * an `update_worker` thread per job, plus two threads per process to read its
+ * output. The exit of each process is watched with a pidfd, and its output is
+ * read as it comes, all through a single `epoll` set. Each slot runs a single
+ * process at a time, and has its own pseudo-terminal for stderr. A slot can
+ * also wait for the response of a persistent worker instead.
+ *
+ * That is only supported on Linux, so the constructor throws a `system_error`
+ * with `ENOSYS` otherwise, in which case the caller should use workers.
+ */
+struct update_loop {
+  /**
+   * A slot whose job is done, with the result of its process, or the error
+   * that prevented getting it, such as an invalid response from a persistent
+   * worker.
+   */
+  struct finished_slot {
+    size_t slot_ix;
+    command_line_result result;
+    std::exception_ptr eptr;
+  };
+  typedef std::vector<finished_slot> results;
+
+  update_loop(size_t slot_count);
+  update_loop(update_loop &) = delete;
+  ~update_loop();
+
+  /**
+   * Start the process of a command line in a slot that is free. If
+   * `has_depfile` is `true`, its depfile is read as well.
+   */
+  void start(size_t slot_ix, const command_line &target, bool has_depfile);
+
+  /**
+   * Send the request to run a command line to a persistent worker, from a
+   * slot that is free. The worker must not be running any other request. The
+   * result is the response of the worker.
+   */
+  void start_tool(size_t slot_ix, tool_process &tool,
+                  const command_line &target);
+
+  /**
+   * Wait until some processes terminate, until `wake` gets called, or until
+   * `timeout_ms` elapsed unless it is negative. The slots and results of the
+   * processes that terminated are appended to `finished`. A process is only
+   * considered terminated once we read all of its output and depfile.
+   */
+  void wait(results &finished, int timeout_ms = -1);
+
+  /**
+   * Make `wait` return, even if no process terminated. This is safe to call
+   * from any thread, for example once a target was checked. A cancellation
+   * signal wakes the loop the same way.
+   */
+  void wake();
+
+private:
+  struct slot {
+    slot();
+
+    std::unique_ptr<io::pseudoterminal> stderr_pty;
+    pid_t pid;
+    io::file_descriptor pidfd;
+    io::file_descriptor stdout_fd;
+    io::file_descriptor depfile_fd;
+    bool exited;
+    bool stdout_open;
+    bool stderr_open;
+    bool depfile_open;
+    tool_process *tool;
+    tool_response_reader tool_reader;
+    command_line_result result;
+    std::exception_ptr eptr;
+  };
+
+  bool read_output_(int fd, std::string &output, bool allow_eio);
+  bool read_tool_response_(slot &sl);
+  bool is_busy_(const slot &sl) const;
+
+  io::file_descriptor epoll_fd_;
+  io::file_descriptor wake_read_fd_;
+  io::file_descriptor wake_write_fd_;
+  std::atomic<bool> wake_pending_;
+  std::vector<slot> slots_;
+};
+
+} // namespace upd
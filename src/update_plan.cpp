@@ -1,4 +1,13 @@
 #include "update_plan.h"
+#include "cancellation.h"
+#include "system/spawn.h"
+#include "tool_process.h"
+#include "update_loop.h"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <system_error>
+#include <thread>
 
 namespace upd {
 
@@ -8,7 +17,9 @@ bool build_update_plan_for_path(
     const std::string &local_target_path, const std::string &local_input_path) {
   auto input_descriptor = output_files_by_path.find(local_input_path);
   if (input_descriptor == output_files_by_path.end()) return false;
-  plan.descendants_by_path[local_input_path].push_back(local_target_path);
+  auto const &local_scheduled_path =
+      input_descriptor->second.local_output_paths[0];
+  plan.descendants_by_path[local_scheduled_path].push_back(local_target_path);
   build_update_plan(plan, output_files_by_path, *input_descriptor);
   return true;
 }
@@ -18,6 +29,13 @@ void build_update_plan(
     const std::unordered_map<std::string, output_file> &output_files_by_path,
     const std::pair<std::string, output_file> &target_descriptor) {
   auto local_target_path = target_descriptor.first;
+  auto const &local_scheduled_path =
+      target_descriptor.second.local_output_paths[0];
+  if (local_scheduled_path != local_target_path) {
+    build_update_plan(plan, output_files_by_path,
+                      *output_files_by_path.find(local_scheduled_path));
+    return;
+  }
   auto pending = plan.pending_output_file_paths.find(local_target_path);
   // FIXME: is this actually useful?
   if (pending != plan.pending_output_file_paths.end()) return;
@@ -42,39 +60,297 @@ void build_update_plan(
                                    local_target_path, local_dependency_path))
       input_count++;
   }
+  for (auto const &local_dyndep_path :
+       target_descriptor.second.dyndep_file_paths) {
+    if (build_update_plan_for_path(plan, output_files_by_path,
+                                   local_target_path, local_dyndep_path))
+      input_count++;
+  }
   if (input_count == 0)
     plan.queued_output_file_paths.push(local_target_path);
   else
     plan.pending_input_counts_by_path[local_target_path] = input_count;
 }
 
+void add_dyndep_dependencies(
+    update_plan &plan,
+    const std::unordered_map<std::string, output_file> &output_files_by_path,
+    const std::string &local_dyndep_path, const depfile::depfile_data &rule) {
+  auto target_iter = output_files_by_path.find(rule.target_path);
+  if (target_iter == output_files_by_path.end()) return;
+  auto const &target_file = target_iter->second;
+  if (target_file.dyndep_file_paths.count(local_dyndep_path) == 0) return;
+  auto const &local_target_path = target_file.local_output_paths[0];
+  if (plan.pending_output_file_paths.count(local_target_path) == 0) return;
+  auto &known_paths = plan.dyndep_dependencies_by_path[local_target_path];
+  for (auto const &local_dependency_path : rule.dependency_paths) {
+    if (!known_paths.insert(local_dependency_path).second) continue;
+    auto dependency_iter = output_files_by_path.find(local_dependency_path);
+    if (dependency_iter == output_files_by_path.end()) continue;
+    auto const &local_scheduled_path =
+        dependency_iter->second.local_output_paths[0];
+    if (plan.done_output_file_paths.count(local_scheduled_path) > 0) continue;
+    build_update_plan_for_path(plan, output_files_by_path, local_target_path,
+                               local_dependency_path);
+    ++plan.pending_input_counts_by_path[local_target_path];
+  }
+}
+
+/**
+ * When we don't know how long the update of a target takes, because none of
+ * the targets were ever updated, we assume they all take that long.
+ */
+static constexpr unsigned long long DEFAULT_DURATION_MS = 1000;
+
+typedef std::unordered_map<std::string, unsigned long long> priorities_by_path;
+
+static unsigned long long add_target_priority(
+    const update_plan &plan, const priorities_by_path &durations,
+    unsigned long long default_duration, const std::string &local_target_path,
+    priorities_by_path &priorities) {
+  auto iter = priorities.find(local_target_path);
+  if (iter != priorities.end()) return iter->second;
+  unsigned long long next_priority = 0;
+  auto descendants_iter = plan.descendants_by_path.find(local_target_path);
+  if (descendants_iter != plan.descendants_by_path.end()) {
+    for (auto const &descendant_path : descendants_iter->second) {
+      next_priority = std::max(
+          next_priority, add_target_priority(plan, durations, default_duration,
+                                             descendant_path, priorities));
+    }
+  }
+  auto duration = durations.find(local_target_path)->second;
+  if (duration == 0) duration = default_duration;
+  return priorities[local_target_path] = duration + next_priority;
+}
+
+/**
+ * The longest chain of updates bounds the duration of the whole update, so
+ * targets at the start of long chains should be updated first. The priority of
+ * a target is the estimated duration of the longest chain that starts with it.
+ * We estimate the duration of each update from the one it took the last time
+ * around, or from the average of the others if we don't know it.
+ */
+static priorities_by_path get_target_priorities(update_context &cx,
+                                                const update_plan &plan) {
+  priorities_by_path durations;
+  unsigned long long total_duration = 0;
+  size_t known_count = 0;
+  for (auto const &local_target_path : plan.pending_output_file_paths) {
+    auto record = cx.log_cache.find(local_target_path);
+    auto duration =
+        record == cx.log_cache.end() ? 0 : record->second.duration_ms;
+    durations[local_target_path] = duration;
+    if (duration == 0) continue;
+    total_duration += duration;
+    ++known_count;
+  }
+  auto default_duration =
+      known_count == 0 ? DEFAULT_DURATION_MS : total_duration / known_count;
+  priorities_by_path priorities;
+  for (auto const &local_target_path : plan.pending_output_file_paths) {
+    add_target_priority(plan, durations, default_duration, local_target_path,
+                        priorities);
+  }
+  return priorities;
+}
+
+/**
+ * A target waiting to be checked or updated. The ones with the highest
+ * priority are taken first, see `get_target_priorities`.
+ */
+struct prioritized_target {
+  unsigned long long priority;
+  std::string local_target_path;
+};
+
+static bool operator<(const prioritized_target &left,
+                      const prioritized_target &right) {
+  return left.priority < right.priority;
+}
+
+typedef std::priority_queue<prioritized_target> target_queue;
+
+/**
+ * Identifies the pool that the updates of a template take their slots from.
+ * Zero stands for the updates that aren't in any pool, that only the global
+ * concurrency limits.
+ */
+static size_t get_pool_key(const command_line_template &tpl) {
+  return tpl.has_pool ? tpl.pool_ix + 1 : 0;
+}
+
+/**
+ * Targets that are known to be out-of-date, waiting for a free slot. These
+ * are queued by pool, so that the targets of a pool that has no free slot
+ * don't hold up the others. Targets of rules that update in batches are
+ * queued by rule as well, so that these can be taken together. Such targets
+ * are in two queues, so once taken from one, they are skipped when they come
+ * up in the other.
+ */
+struct ready_targets {
+  void push(prioritized_target target, const output_file &file,
+            size_t pool_key) {
+    if (file.batch_size > 1) by_rule_[file.rule_ix].push(target);
+    by_pool_[pool_key].push(std::move(target));
+  }
+
+  bool empty() {
+    for (auto &entry : by_pool_) {
+      drop_taken_(entry.second);
+      if (!entry.second.empty()) return false;
+    }
+    return true;
+  }
+
+  /**
+   * Take the target with the highest priority among the pools for which
+   * `has_free_slot` returns `true`. Returns an empty string if there is none.
+   */
+  template <typename HasFreeSlot>
+  std::string pop(const update_map &updm, HasFreeSlot has_free_slot) {
+    target_queue *queue = nullptr;
+    for (auto &entry : by_pool_) {
+      drop_taken_(entry.second);
+      if (entry.second.empty() || !has_free_slot(entry.first)) continue;
+      if (queue == nullptr || queue->top() < entry.second.top()) {
+        queue = &entry.second;
+      }
+    }
+    if (queue == nullptr) return std::string();
+    auto local_target_path = queue->top().local_target_path;
+    queue->pop();
+    auto const &file =
+        updm.output_files_by_path.find(local_target_path)->second;
+    if (file.batch_size > 1) taken_.insert(local_target_path);
+    return local_target_path;
+  }
+
+  /**
+   * Take up to `count` more targets of that rule, by order of priority.
+   */
+  void pop_batch(size_t rule_ix, size_t count,
+                 std::vector<std::string> &local_target_paths) {
+    auto &queue = by_rule_[rule_ix];
+    while (count > 0) {
+      drop_taken_(queue);
+      if (queue.empty()) return;
+      local_target_paths.push_back(queue.top().local_target_path);
+      taken_.insert(queue.top().local_target_path);
+      queue.pop();
+      --count;
+    }
+  }
+
+private:
+  void drop_taken_(target_queue &queue) {
+    while (!queue.empty()) {
+      auto iter = taken_.find(queue.top().local_target_path);
+      if (iter == taken_.end()) return;
+      taken_.erase(iter);
+      queue.pop();
+    }
+  }
+
+  std::unordered_map<size_t, target_queue> by_pool_;
+  std::unordered_map<size_t, target_queue> by_rule_;
+  std::unordered_set<std::string> taken_;
+};
+
+/**
+ * A target that a slot is updating. There may be several at a time, if they
+ * are updated in a batch.
+ */
+struct scheduled_target {
+  std::string local_target_path;
+  const output_file *file;
+  const update_log::file_record *previous_record;
+  std::unordered_set<std::string> dyndep_dependency_paths;
+};
+
+/**
+ * The state of each slot that runs updates. Unless the pool runs processes
+ * with an `update_loop`, each slot has its own worker thread.
+ */
 struct worker_state {
-  worker_state(std::mutex &mutex, std::condition_variable &cv)
-      : status(worker_status::idle), cli_template(nullptr),
-        local_src_paths(nullptr), order_only_dep_file_paths(nullptr),
-        worker(status, result, sfu.job, mutex, cv) {}
+  worker_state(std::mutex &mutex, std::condition_variable &cv,
+               bool has_worker)
+      : status(worker_status::idle), cli_template(nullptr) {
+    if (!has_worker) return;
+    worker = std::make_unique<update_worker>(status, result, eptr, sfu.job,
+                                             mutex, cv);
+  }
   worker_state(worker_state &) = delete;
   worker_state(worker_state &&other) = delete;
 
   worker_status status;
   command_line_result result;
+  std::exception_ptr eptr;
   scheduled_file_update sfu;
-  std::string local_target_path;
+  std::vector<scheduled_target> targets;
   const command_line_template *cli_template;
-  const std::vector<std::string> *local_src_paths;
-  const std::vector<std::vector<std::string>> *dep_groups;
-  const std::unordered_set<std::string> *order_only_dep_file_paths;
-  update_worker worker;
+  std::chrono::steady_clock::time_point start_time;
+  std::unique_ptr<update_worker> worker;
+  /**
+   * The persistent worker that runs the update in progress, if its template
+   * has one. It goes back to the pool once the update finished.
+   */
+  std::unique_ptr<tool_process> tool;
+};
+
+/**
+ * The outcome of checking if a target is up-to-date. If the check failed, for
+ * example because the target was changed manually, `eptr` holds the error.
+ */
+struct check_result {
+  std::string local_target_path;
+  bool up_to_date;
+  std::exception_ptr eptr;
 };
 
 struct worker_pool {
-  worker_pool() : lock(state_mutex){};
+  worker_pool()
+      : lock(state_mutex), idle_checker_count(0), checkers_shutdown(false){};
   ~worker_pool();
 
   std::mutex state_mutex;
   std::unique_lock<std::mutex> lock;
   std::condition_variable global_cv;
   std::vector<std::unique_ptr<worker_state>> worker_states;
+
+  /**
+   * Targets are checked for being up-to-date on separate threads, so that
+   * hashing can happen in parallel, and while update processes are running.
+   * The targets that remain to check, and the results of checks that the
+   * scheduler did not handle yet, are protected by `state_mutex`.
+   */
+  target_queue check_queue;
+  std::queue<check_result> check_results;
+  /**
+   * With an `update_loop`, the slots whose process terminated, and whose
+   * update remains to be finalized. Checkers take care of these first, so that
+   * the scheduler thread doesn't get to parse depfiles or hash outputs.
+   */
+  std::queue<size_t> finalize_queue;
+  size_t idle_checker_count;
+  bool checkers_shutdown;
+  std::condition_variable checkers_cv;
+  std::vector<std::thread> checkers;
+
+  /**
+   * Runs the update processes from the scheduler thread, when the system
+   * supports it. Otherwise, this is `nullptr` and each slot has a worker.
+   */
+  std::unique_ptr<update_loop> loop;
+
+  /**
+   * The persistent workers that aren't running any update, by template. They
+   * are kept until the end of the whole update, so that each one can run many
+   * updates without starting again.
+   */
+  std::unordered_map<const command_line_template *,
+                     std::vector<std::unique_ptr<tool_process>>>
+      idle_tools;
 };
 
 /**
@@ -84,130 +360,584 @@ struct worker_pool {
 worker_pool::~worker_pool() {
   if (!lock.owns_lock()) lock.lock();
   for (auto &ws : worker_states) {
+    if (!ws->worker) continue;
     ws->status = worker_status::shutdown;
-    ws->worker.notify();
+    ws->worker->notify();
   }
+  checkers_shutdown = true;
+  checkers_cv.notify_all();
   lock.unlock();
   for (auto &ws : worker_states) {
-    ws->worker.join();
+    if (ws->worker) ws->worker->join();
+  }
+  for (auto &checker : checkers) {
+    checker.join();
+  }
+  loop.reset();
+}
+
+/**
+ * Finalize the update of a slot whose process terminated, on a checker
+ * thread, like its worker would have otherwise. The slot is only marked as
+ * finished after that, so that the scheduler leaves it alone until then.
+ */
+static void run_finalize(worker_pool &pool, std::unique_lock<std::mutex> &lock,
+                         size_t slot_ix) {
+  auto &st = *pool.worker_states[slot_ix];
+  lock.unlock();
+  try {
+    if (st.sfu.job.finalize) st.sfu.job.finalize(st.result);
+  } catch (...) {
+    st.eptr = std::current_exception();
+  }
+  lock.lock();
+  st.status = worker_status::finished;
+}
+
+/**
+ * Check queued targets until the pool shuts down. Records of the update log
+ * are only looked up while holding the state lock, because the scheduler
+ * records new entries concurrently. The records themselves stay valid, as
+ * the one of a target being checked cannot be replaced at the same time.
+ */
+static void run_checker(worker_pool &pool, update_context &cx,
+                        const update_map &updm,
+                        const std::vector<command_line_template> &templates) {
+  std::unique_lock<std::mutex> lock(pool.state_mutex);
+  while (!pool.checkers_shutdown) {
+    if (!pool.finalize_queue.empty()) {
+      auto slot_ix = pool.finalize_queue.front();
+      pool.finalize_queue.pop();
+      --pool.idle_checker_count;
+      run_finalize(pool, lock, slot_ix);
+      ++pool.idle_checker_count;
+      pool.global_cv.notify_all();
+      pool.loop->wake();
+      continue;
+    }
+    if (pool.check_queue.empty()) {
+      pool.checkers_cv.wait(lock);
+      continue;
+    }
+    check_result result{pool.check_queue.top().local_target_path, false,
+                        nullptr};
+    pool.check_queue.pop();
+    --pool.idle_checker_count;
+    auto const &target_file =
+        updm.output_files_by_path.find(result.local_target_path)->second;
+    std::vector<const update_log::file_record *> records;
+    for (auto const &local_output_path : target_file.local_output_paths) {
+      auto entry = cx.log_cache.find(local_output_path);
+      records.push_back(entry == cx.log_cache.end() ? nullptr : &entry->second);
+    }
+    std::vector<update_log::file_stat> new_stats(records.size());
+    lock.unlock();
+    try {
+      // The target is only up-to-date if all the outputs of its command are.
+      result.up_to_date = true;
+      for (size_t i = 0; i < records.size() && result.up_to_date; ++i) {
+        result.up_to_date = is_file_up_to_date(
+            records[i], cx.log_cache.ents(), cx.hash_cache, cx.root_path,
+            target_file.local_output_paths[i],
+            target_file.local_input_file_paths, target_file.dependency_groups,
+            templates[target_file.command_line_ix], new_stats[i]);
+      }
+    } catch (...) {
+      result.eptr = std::current_exception();
+    }
+    lock.lock();
+    // Outputs that are up-to-date, but were racy when they got recorded, get
+    // their stat data recorded now, so that we don't hash them every time.
+    for (size_t i = 0; i < records.size() && result.up_to_date && !result.eptr;
+         ++i) {
+      if (new_stats[i] == update_log::file_stat()) continue;
+      auto record = *records[i];
+      record.stat = new_stats[i];
+      cx.log_cache.record(target_file.local_output_paths[i], record);
+    }
+    ++pool.idle_checker_count;
+    pool.check_results.push(std::move(result));
+    pool.global_cv.notify_all();
+    if (pool.loop) pool.loop->wake();
+  }
+}
+
+/**
+ * Compute and record the result of a successful update. This runs on the
+ * worker thread, or on a checker with an `update_loop`, and only takes the
+ * state lock to record the result, so that the scheduler can keep dispatching
+ * updates in the meantime. Targets updated in a batch get a record each, and
+ * share the duration of the update. Other outputs of a target get the same
+ * record as the target, but for their own content.
+ */
+static void finalize_update(update_context &cx, const update_map &updm,
+                            worker_pool &pool, worker_state &st,
+                            const command_line_result &result) {
+  if (!is_successful(result)) return;
+  auto duration = std::chrono::steady_clock::now() - st.start_time;
+  auto duration_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() /
+      st.targets.size();
+  std::vector<std::string> local_target_paths;
+  for (auto const &target : st.targets) {
+    local_target_paths.push_back(target.local_target_path);
+  }
+  auto dependencies =
+      get_depfile_dependencies(cx, result.depfile, local_target_paths);
+  std::vector<std::pair<std::string, update_log::file_record>> records;
+  for (size_t i = 0; i < st.targets.size(); ++i) {
+    auto const &target = st.targets[i];
+    auto const &file = *target.file;
+    for (auto const &local_output_path : file.local_output_paths) {
+      records.emplace_back(
+          local_output_path,
+          finalize_scheduled_update(
+              cx, dependencies[i], *st.cli_template,
+              file.local_input_file_paths, file.dependency_groups,
+              local_output_path, updm, file.order_only_dependency_file_paths,
+              target.dyndep_dependency_paths, target.previous_record));
+      // Zero means unknown, so even the fastest updates take a millisecond.
+      records.back().second.duration_ms =
+          std::max<unsigned long long>(1, duration_ms);
+    }
+  }
+  std::lock_guard<std::mutex> lock(pool.state_mutex);
+  for (auto const &entry : records) {
+    cx.log_cache.record(entry.first, entry.second);
+  }
+}
+
+/**
+ * Get a persistent worker of that template that isn't running any update, or
+ * start a new one. As each one runs a single update at a time, there are never
+ * more of these for a template than the concurrency.
+ */
+static std::unique_ptr<tool_process>
+take_idle_tool(worker_pool &pool, const command_line_template &tpl) {
+  auto &tools = pool.idle_tools[&tpl];
+  if (tools.empty()) return std::make_unique<tool_process>(tpl);
+  auto tool = std::move(tools.back());
+  tools.pop_back();
+  return tool;
+}
+
+/**
+ * Remove a target from the plan once it is up-to-date. If any of its outputs
+ * is a dyndep file, the dependencies it lists are added to the plan first, so
+ * that the targets that have that dyndep file don't get released before them.
+ * We read all of these before touching the plan, so that the target stays in
+ * it as it was if one cannot be read.
+ */
+static void complete_target(update_context &cx, const update_map &updm,
+                            update_plan &plan,
+                            const std::string &local_target_path) {
+  auto const &target_file =
+      updm.output_files_by_path.find(local_target_path)->second;
+  std::vector<std::pair<const std::string *, depfile::depfile_data>> rules;
+  for (auto const &local_output_path : target_file.local_output_paths) {
+    if (updm.dyndep_file_paths.count(local_output_path) == 0) continue;
+    for (auto &rule : read_dyndep_file(cx, local_output_path)) {
+      rules.emplace_back(&local_output_path, std::move(rule));
+    }
+  }
+  for (auto const &entry : rules) {
+    add_dyndep_dependencies(plan, updm.output_files_by_path, *entry.first,
+                            entry.second);
+  }
+  plan.erase(local_target_path);
+}
+
+/**
+ * Report an error that prevented a single target from getting updated, such as
+ * a missing output or an invalid depfile, so that we can carry on with the
+ * others. Without `--keep-going`, or for any other kind of error, it
+ * propagates instead.
+ */
+static void report_target_error(const update_context &cx,
+                                std::exception_ptr eptr) {
+  try {
+    std::rethrow_exception(eptr);
+  } catch (const undeclared_rule_dependency_error &error) {
+    if (cx.failure_limit == 1) throw;
+    std::cerr << "upd: error: " << error << std::endl;
+  } catch (const file_changed_manually_error &error) {
+    if (cx.failure_limit == 1) throw;
+    std::cerr << "upd: error: " << error << std::endl;
+  } catch (const invalid_tool_response_error &error) {
+    if (cx.failure_limit == 1) throw;
+    std::cerr << "upd: error: " << error << std::endl;
+  } catch (const depfile::parse_error &error) {
+    if (cx.failure_limit == 1) throw;
+    std::cerr << "upd: error: invalid depfile or dyndep file: "
+              << error.message() << std::endl;
+  } catch (const std::system_error &error) {
+    if (cx.failure_limit == 1) throw;
+    std::cerr << "upd: error: " << error.what() << std::endl;
+  }
+}
+
+static void report_failed_target(const std::string &local_target_path) {
+  std::cerr << "upd: error: failed to update: " << local_target_path
+            << std::endl;
+}
+
+/**
+ * Whether we reached the number of failures after which we stop starting new
+ * updates. A limit of zero means there is none.
+ */
+static bool has_too_many_failures(const update_context &cx,
+                                  size_t failure_count) {
+  return cx.failure_limit != 0 && failure_count >= cx.failure_limit;
+}
+
+/**
+ * Handle the workers that finished running their update process. Returns how
+ * many of these processes failed. The targets of a failed process stay in the
+ * plan, so the files that depend on them never get released.
+ */
+static size_t finish_updates(update_context &cx, const update_map &updm,
+                             update_plan &plan, worker_pool &pool) {
+  size_t failure_count = 0;
+  for (auto &ws : pool.worker_states) {
+    if (ws->status != worker_status::finished) continue;
+    auto &st = *ws;
+    st.status = worker_status::idle;
+    // A worker that failed to respond properly might not get the next
+    // request right, so we don't keep it.
+    if (st.tool && !st.tool->exited() && !st.eptr) {
+      pool.idle_tools[st.cli_template].push_back(std::move(st.tool));
+    }
+    st.tool.reset();
+
+    std::cerr << st.result.stderr;
+    if (st.eptr) {
+      auto eptr = st.eptr;
+      st.eptr = nullptr;
+      report_target_error(cx, eptr);
+      for (auto const &target : st.targets) {
+        report_failed_target(target.local_target_path);
+      }
+      ++failure_count;
+      continue;
+    }
+
+    bool has_error = false;
+    if (st.result.stdout.size() > 0) {
+      std::cerr << "upd: error: process has unexpected output on stdout"
+                << std::endl
+                << "Update commands are not allowed to produce output except "
+                << "diagnostics on strerr." << std::endl
+                << "========= STDOUT =========" << std::endl
+                << st.result.stdout << "========= END =========" << std::endl;
+      has_error = true;
+    }
+    auto exit_code = WEXITSTATUS(st.result.status);
+    if (WIFEXITED(st.result.status) == 0) {
+      std::cerr << "upd: error: process did not exit normally" << std::endl;
+      has_error = true;
+      if (WIFSIGNALED(st.result.status) != 0) {
+        std::cerr << "upd: error: process exited by signal "
+                  << WTERMSIG(st.result.status) << std::endl;
+      }
+    } else if (exit_code != 0) {
+      std::cerr << "upd: error: process terminated with exit code "
+                << exit_code << std::endl;
+      has_error = true;
+    }
+    if (has_error) {
+      for (auto const &target : st.targets) {
+        report_failed_target(target.local_target_path);
+      }
+      ++failure_count;
+      continue;
+    }
+    // Reading the dyndep files it generated can still fail. That counts as a
+    // single failure of the update, whatever the number of targets.
+    for (auto const &target : st.targets) {
+      try {
+        complete_target(cx, updm, plan, target.local_target_path);
+      } catch (...) {
+        report_target_error(cx, std::current_exception());
+        report_failed_target(target.local_target_path);
+        has_error = true;
+      }
+    }
+    if (has_error) ++failure_count;
+  }
+  return failure_count;
+}
+
+/**
+ * A signal handler cannot notify a condition variable, so that's how often we
+ * check if we were asked to stop while waiting for workers.
+ */
+static constexpr auto CANCELLATION_CHECK_INTERVAL =
+    std::chrono::milliseconds(100);
+
+/**
+ * How long the processes still running have to terminate once we forwarded
+ * them the signal that asked us to stop, before we kill them.
+ */
+static constexpr auto CANCELLATION_GRACE_PERIOD = std::chrono::seconds(5);
+
+/**
+ * Wait until a check or an update finishes, until we get asked to stop, or
+ * until `timeout_ms` elapsed unless it is negative. With an `update_loop`, we
+ * hand the updates of the processes that terminated to the checkers, to get
+ * finalized as workers would otherwise. There is always at least a checker,
+ * as each update follows the check of its targets.
+ */
+static void wait_for_progress(worker_pool &pool, int timeout_ms = -1) {
+  if (!pool.loop) {
+    auto timeout = CANCELLATION_CHECK_INTERVAL;
+    if (timeout_ms >= 0) {
+      timeout = std::min(timeout, std::chrono::milliseconds(timeout_ms));
+    }
+    pool.global_cv.wait_for(pool.lock, timeout);
+    return;
+  }
+  update_loop::results finished;
+  pool.lock.unlock();
+  pool.loop->wait(finished, timeout_ms);
+  pool.lock.lock();
+  for (auto &entry : finished) {
+    auto &st = *pool.worker_states[entry.slot_ix];
+    st.result = std::move(entry.result);
+    st.eptr = entry.eptr;
+    if (st.eptr) {
+      st.status = worker_status::finished;
+      continue;
+    }
+    pool.finalize_queue.push(entry.slot_ix);
+    pool.checkers_cv.notify_one();
+  }
+}
+
+/**
+ * Whether one more update can start in that pool (see `get_pool_key`).
+ * Updates that are finished still take their slot until they are handled.
+ */
+static bool has_free_pool_slot(const worker_pool &pool,
+                               const std::vector<manifest::update_pool> &pools,
+                               size_t pool_key) {
+  if (pool_key == 0) return true;
+  size_t update_count = 0;
+  for (auto const &ws : pool.worker_states) {
+    if (ws->status == worker_status::idle) continue;
+    if (get_pool_key(*ws->cli_template) == pool_key) ++update_count;
+  }
+  return update_count < pools[pool_key - 1].concurrency;
+}
+
+static void get_worker_states(const worker_pool &pool, bool &has_in_progress,
+                              bool &has_finished) {
+  has_in_progress = false;
+  has_finished = false;
+  for (auto const &ws : pool.worker_states) {
+    if (ws->status == worker_status::in_progress) has_in_progress = true;
+    if (ws->status == worker_status::finished) has_finished = true;
+  }
+}
+
+/**
+ * Let the updates in progress finish, without starting any new one. If we
+ * get asked to stop, we forward the signal to their processes, and to the
+ * persistent workers, and kill the ones still running once the grace period
+ * elapsed, or as soon as we get asked to stop again.
+ */
+static void drain_updates(update_context &cx, const update_map &updm,
+                          update_plan &plan, worker_pool &pool) {
+  bool signalled = false, killed = false;
+  std::chrono::steady_clock::time_point deadline;
+  while (true) {
+    bool has_in_progress, has_finished;
+    get_worker_states(pool, has_in_progress, has_finished);
+    if (has_finished) {
+      finish_updates(cx, updm, plan, pool);
+      continue;
+    }
+    if (!has_in_progress) return;
+    int timeout_ms = -1;
+    auto signal = get_cancellation_signal();
+    if (signal != 0 && !killed) {
+      auto now = std::chrono::steady_clock::now();
+      if (!signalled) {
+        system::kill_all(signal);
+        signalled = true;
+        deadline = now + CANCELLATION_GRACE_PERIOD;
+      }
+      if (now >= deadline || get_cancellation_count() > 1) {
+        system::kill_all(SIGKILL);
+        killed = true;
+      } else {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - now);
+        timeout_ms = static_cast<int>(remaining.count()) + 1;
+      }
+    }
+    wait_for_progress(pool, timeout_ms);
   }
 }
 
 void execute_update_plan(
     update_context &cx, const update_map &updm, update_plan &plan,
-    std::vector<command_line_template> command_line_templates) {
+    std::vector<command_line_template> command_line_templates,
+    const std::vector<manifest::update_pool> &pools) {
 
   worker_pool pool;
   std::vector<std::unique_ptr<worker_state>> &worker_states =
       pool.worker_states;
+  ready_targets ready_paths;
+  size_t pending_check_count = 0;
+  size_t failure_count = 0;
+  auto priorities = get_target_priorities(cx, plan);
+  try {
+    pool.loop = std::make_unique<update_loop>(cx.concurrency);
+  } catch (const std::system_error &error) {
+    if (error.code() != std::errc::function_not_supported) throw;
+  }
 
   while (!plan.pending_output_file_paths.empty()) {
+    if (get_cancellation_signal() != 0) {
+      drain_updates(cx, updm, plan, pool);
+      break;
+    }
     while (!plan.queued_output_file_paths.empty()) {
-      auto local_target_path = plan.queued_output_file_paths.front();
-      auto &target_descriptor =
-          *updm.output_files_by_path.find(local_target_path);
-      auto const &target_file = target_descriptor.second;
-      auto const &command_line_tpl =
-          command_line_templates[target_file.command_line_ix];
-      auto const &local_src_paths = target_file.local_input_file_paths;
-      if (is_file_up_to_date(cx.log_cache, cx.hash_cache, cx.root_path,
-                             local_target_path, local_src_paths,
-                             target_file.dependency_groups, command_line_tpl)) {
-        plan.queued_output_file_paths.pop();
-        plan.erase(local_target_path);
-        continue;
+      auto &local_target_path = plan.queued_output_file_paths.front();
+      auto priority = priorities[local_target_path];
+      pool.check_queue.push({priority, std::move(local_target_path)});
+      plan.queued_output_file_paths.pop();
+      ++pending_check_count;
+      pool.checkers_cv.notify_one();
+    }
+    // Updates to finalize may be waiting for a checker too.
+    while (pool.check_queue.size() + pool.finalize_queue.size() >
+               pool.idle_checker_count &&
+           pool.checkers.size() < cx.concurrency) {
+      ++pool.idle_checker_count;
+      pool.checkers.emplace_back(&run_checker, std::ref(pool), std::ref(cx),
+                                 std::cref(updm),
+                                 std::cref(command_line_templates));
+    }
+
+    while (!pool.check_results.empty()) {
+      auto result = std::move(pool.check_results.front());
+      pool.check_results.pop();
+      --pending_check_count;
+      if (!result.eptr && result.up_to_date) {
+        try {
+          complete_target(cx, updm, plan, result.local_target_path);
+          continue;
+        } catch (...) {
+          result.eptr = std::current_exception();
+        }
       }
+      if (result.eptr) {
+        // The target stays in the plan, so its dependents never get released.
+        report_target_error(cx, result.eptr);
+        report_failed_target(result.local_target_path);
+        ++failure_count;
+      } else {
+        auto priority = priorities[result.local_target_path];
+        auto const &target_file =
+            updm.output_files_by_path.find(result.local_target_path)->second;
+        auto pool_key =
+            get_pool_key(command_line_templates[target_file.command_line_ix]);
+        ready_paths.push({priority, std::move(result.local_target_path)},
+                         target_file, pool_key);
+      }
+    }
+    if (has_too_many_failures(cx, failure_count)) {
+      drain_updates(cx, updm, plan, pool);
+      break;
+    }
+    if (!plan.queued_output_file_paths.empty()) continue;
 
+    while (!ready_paths.empty()) {
       size_t i = 0;
       while (i < worker_states.size() &&
              worker_states[i]->status != worker_status::idle)
         ++i;
+      if (i == worker_states.size() && i >= cx.concurrency) break;
+      auto first_target_path =
+          ready_paths.pop(updm, [&pool, &pools](size_t pool_key) {
+            return has_free_pool_slot(pool, pools, pool_key);
+          });
+      if (first_target_path.empty()) break;
       if (i == worker_states.size()) {
-        if (i >= cx.concurrency) break;
-        auto wr =
-            std::make_unique<worker_state>(pool.state_mutex, pool.global_cv);
+        auto wr = std::make_unique<worker_state>(
+            pool.state_mutex, pool.global_cv, pool.loop == nullptr);
         worker_states.push_back(std::move(wr));
       }
-      plan.queued_output_file_paths.pop();
+      std::vector<std::string> local_target_paths{first_target_path};
+      auto const &target_file =
+          updm.output_files_by_path.find(local_target_paths[0])->second;
+      if (target_file.batch_size > 1) {
+        ready_paths.pop_batch(target_file.rule_ix, target_file.batch_size - 1,
+                              local_target_paths);
+      }
+      auto const &command_line_tpl =
+          command_line_templates[target_file.command_line_ix];
 
+      // Targets of the same rule have the same dependencies, so only their
+      // inputs differ.
       auto &st = *worker_states[i];
+      std::vector<std::string> local_src_paths;
+      std::vector<std::string> local_output_paths;
+      st.targets.clear();
+      for (auto &local_target_path : local_target_paths) {
+        auto const &file =
+            updm.output_files_by_path.find(local_target_path)->second;
+        local_src_paths.insert(local_src_paths.end(),
+                               file.local_input_file_paths.begin(),
+                               file.local_input_file_paths.end());
+        local_output_paths.insert(local_output_paths.end(),
+                                  file.local_output_paths.begin(),
+                                  file.local_output_paths.end());
+        auto record = cx.log_cache.find(local_target_path);
+        st.targets.push_back(
+            {local_target_path, &file,
+             record == cx.log_cache.end() ? nullptr : &record->second,
+             plan.dyndep_dependencies_by_path[local_target_path]});
+      }
       st.sfu = schedule_file_update(cx, command_line_tpl, local_src_paths,
-                                    local_target_path,
+                                    local_target_paths, local_output_paths,
                                     target_file.dependency_groups);
       st.cli_template = &command_line_tpl;
-      st.local_src_paths = &local_src_paths;
-      st.dep_groups = &target_file.dependency_groups;
-      st.local_target_path = std::move(local_target_path);
-      st.order_only_dep_file_paths =
-          &target_file.order_only_dependency_file_paths;
-      st.status = worker_status::in_progress;
-      st.worker.notify();
-    }
-
-    bool has_errors = false;
-    bool has_in_progress;
-    do {
-      do {
-        has_in_progress = false;
-        bool has_finished = false;
-        for (size_t i = 0; i < worker_states.size(); ++i) {
-          if (worker_states[i]->status == worker_status::in_progress)
-            has_in_progress = true;
-          if (worker_states[i]->status == worker_status::finished)
-            has_finished = true;
-        }
-        if (has_finished || !has_in_progress) break;
-        pool.global_cv.wait(pool.lock);
-      } while (true);
-
-      for (size_t i = 0; i < worker_states.size(); ++i) {
-        if (worker_states[i]->status != worker_status::finished) continue;
-        auto &st = *worker_states[i];
-        st.status = worker_status::idle;
-
-        std::cerr << st.result.stderr;
-
-        bool has_error = false;
-        if (st.result.stdout.size() > 0) {
-          std::cerr
-              << "upd: error: process has unexpected output on stdout"
-              << std::endl
-              << "Update commands are not allowed to produce output except "
-              << "diagnostics on strerr." << std::endl
-              << "========= STDOUT =========" << std::endl
-              << st.result.stdout << "========= END =========" << std::endl;
-          has_error = true;
-        }
-        auto exit_code = WEXITSTATUS(st.result.status);
-        if (WIFEXITED(st.result.status) == 0) {
-          std::cerr << "upd: error: process did not exit normally" << std::endl;
-          has_error = true;
-          if (WIFSIGNALED(st.result.status) != 0) {
-            std::cerr << "upd: error: process exited by signal "
-                      << WTERMSIG(st.result.status) << std::endl;
-          }
-        } else if (exit_code != 0) {
-          std::cerr << "upd: error: process terminated with exit code "
-                    << exit_code << std::endl;
-          has_error = true;
-        }
-        if (has_error) {
-          has_errors = true;
-          // FIXME: we still need to remove the depfile FIFO and stuff that
-          // is done by `finalize_scheduled_update`
-          continue;
-        }
-
-        finalize_scheduled_update(
-            cx, st.sfu, *st.cli_template, *st.local_src_paths, *st.dep_groups,
-            st.local_target_path, updm, *st.order_only_dep_file_paths);
-        plan.erase(st.local_target_path);
+      st.sfu.job.finalize = [&cx, &updm, &pool,
+                             &st](const command_line_result &result) {
+        finalize_update(cx, updm, pool, st, result);
+      };
+      if (command_line_tpl.persistent_worker) {
+        st.tool = take_idle_tool(pool, command_line_tpl);
+        st.sfu.job.tool = st.tool.get();
+      }
+      st.start_time = std::chrono::steady_clock::now();
+      if (pool.loop && st.tool) {
+        pool.loop->start_tool(i, *st.tool, st.sfu.job.target);
+      } else if (pool.loop) {
+        pool.loop->start(i, st.sfu.job.target, st.sfu.job.has_depfile);
       }
-    } while (has_errors && has_in_progress);
+      st.status = worker_status::in_progress;
+      if (st.worker) st.worker->notify();
+    }
 
-    if (has_errors) {
-      break;
+    bool has_in_progress, has_finished;
+    get_worker_states(pool, has_in_progress, has_finished);
+    if (!has_finished) {
+      // Nothing can make progress anymore. The targets left depend on ones
+      // that failed to update, or the plan must be corrupted.
+      if (!has_in_progress && pending_check_count == 0) break;
+      if (pool.check_results.empty()) wait_for_progress(pool);
+      continue;
     }
+    failure_count += finish_updates(cx, updm, plan, pool);
+    if (!has_too_many_failures(cx, failure_count)) continue;
+
+    // Too many updates failed, so we let the ones in progress finish, but we
+    // don't start any new one.
+    drain_updates(cx, updm, plan, pool);
+    break;
   }
 }
 
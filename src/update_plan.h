@@ -1,5 +1,6 @@
 #pragma once
 
+#include "../gen/src/manifest/manifest.h"
 #include "command_line_template.h"
 #include "update.h"
 #include <queue>
@@ -17,10 +18,12 @@ struct update_plan {
   /**
    * Remove a file from the plan, for example because we finished updating it
    * succesfully. This potentially allows descendants to be available for
-   * update.
+   * update, including the descendants of the other outputs of its command, as
+   * these are only ever in the plan through that file.
    */
   void erase(const std::string &local_target_path) {
     pending_output_file_paths.erase(local_target_path);
+    done_output_file_paths.insert(local_target_path);
     auto descendants_iter = descendants_by_path.find(local_target_path);
     if (descendants_iter == descendants_by_path.end()) {
       return;
@@ -41,7 +44,8 @@ struct update_plan {
   /**
    * The paths of all the output files that are ready to be updated immediately.
    * These files' dependencies either have already been updated, or they are
-   * source files written manually.
+   * source files written manually. The order doesn't matter, as the files are
+   * updated by order of priority (see `execute_update_plan`).
    */
   std::queue<std::string> queued_output_file_paths;
 
@@ -50,6 +54,12 @@ struct update_plan {
    */
   std::unordered_set<std::string> pending_output_file_paths;
 
+  /**
+   * The files that were removed from the plan, as opposed to the files that
+   * were never part of it.
+   */
+  std::unordered_set<std::string> done_output_file_paths;
+
   /**
    * For each output file path, indicates how many input files still need to be
    * updated before the output file can be updated.
@@ -58,9 +68,17 @@ struct update_plan {
 
   /**
    * For each input file path, indicates what files could potentially be
-   * updated after the input file is updated.
+   * updated after the input file is updated. An input that is not the first
+   * output of its command has its descendants under that first output.
    */
   std::unordered_map<std::string, std::vector<std::string>> descendants_by_path;
+
+  /**
+   * For each output file path, the dependencies that its dyndep files listed
+   * for it. The generated ones are added to the plan as inputs of the file.
+   */
+  std::unordered_map<std::string, std::unordered_set<std::string>>
+      dyndep_dependencies_by_path;
 };
 
 bool build_update_plan_for_path(
@@ -73,8 +91,21 @@ void build_update_plan(
     const std::unordered_map<std::string, output_file> &output_files_by_path,
     const std::pair<std::string, output_file> &target_descriptor);
 
+/**
+ * Add the dependencies that the dyndep file `local_dyndep_path` lists for a
+ * target, once that file is updated. This only applies to targets that have
+ * that dyndep file, as they cannot have started updating yet. Generated
+ * dependencies that are not updated yet become inputs of the target, and are
+ * added to the plan if needed.
+ */
+void add_dyndep_dependencies(
+    update_plan &plan,
+    const std::unordered_map<std::string, output_file> &output_files_by_path,
+    const std::string &local_dyndep_path, const depfile::depfile_data &rule);
+
 void execute_update_plan(
     update_context &context, const update_map &updm, update_plan &plan,
-    std::vector<command_line_template> command_line_templates);
+    std::vector<command_line_template> command_line_templates,
+    const std::vector<manifest::update_pool> &pools);
 
 } // namespace upd
@@ -9,9 +9,10 @@
 namespace upd {
 
 update_worker::update_worker(worker_status &status, command_line_result &result,
-                             update_job &job, std::mutex &mutex,
+                             std::exception_ptr &eptr, update_job &job,
+                             std::mutex &mutex,
                              std::condition_variable &output_cv)
-    : status_(status), result_(result), job_(job), mutex_(mutex),
+    : status_(status), result_(result), eptr_(eptr), job_(job), mutex_(mutex),
       output_cv_(output_cv), thread_(&update_worker::run_, this) {}
 
 void update_worker::run_() {
@@ -24,10 +25,21 @@ void update_worker::run_() {
     status_ = worker_status::in_progress;
     mutex_.unlock();
     std::exception_ptr eptr;
-    auto result =
-        run_command_line(job_.target, stderr_pty_.fd(), stderr_pty_.ptsname());
+    command_line_result result;
+    try {
+      if (job_.tool != nullptr) {
+        result = job_.tool->run(job_.target);
+      } else {
+        result = run_command_line(job_.target, stderr_pty_.fd(),
+                                  stderr_pty_.ptsname(), job_.has_depfile);
+      }
+      if (job_.finalize) job_.finalize(result);
+    } catch (...) {
+      eptr = std::current_exception();
+    }
     mutex_.lock();
     result_ = std::move(result);
+    eptr_ = eptr;
     status_ = worker_status::finished;
     output_cv_.notify_all();
   }
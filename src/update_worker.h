@@ -3,7 +3,10 @@
 #include "io/file_descriptor.h"
 #include "io/pseudoterminal.h"
 #include "run_command_line.h"
+#include "tool_process.h"
 #include <condition_variable>
+#include <exception>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -14,17 +17,33 @@ namespace upd {
 struct update_job {
   std::string root_path;
   command_line target;
+  /**
+   * Whether the process writes a depfile, as `DEPFILE_PATH`.
+   */
+  bool has_depfile;
+  /**
+   * The persistent worker that runs the command line, if its template has
+   * one, rather than a process of its own.
+   */
+  tool_process *tool;
+  /**
+   * Called by the worker, or by a checker with an `update_loop`, right after
+   * the command terminated, without holding the lock, so that the result can
+   * be processed without involving the scheduler thread.
+   */
+  std::function<void(const command_line_result &)> finalize;
 };
 
 enum class worker_status { idle, in_progress, finished, shutdown };
 
 /**
  * Because we start a thread referencing the internal condition variable,
- * instances cannot be moved (not copied).
+ * instances cannot be moved (not copied). If running or finalizing the job
+ * fails, the error is stored in `eptr` for the scheduler to handle.
  */
 struct update_worker {
   update_worker(worker_status &status, command_line_result &result,
-                update_job &job, std::mutex &mutex,
+                std::exception_ptr &eptr, update_job &job, std::mutex &mutex,
                 std::condition_variable &output_cv);
   update_worker(update_worker &) = delete;
   update_worker(update_worker &&) = delete;
@@ -36,6 +55,7 @@ private:
 
   worker_status &status_;
   command_line_result &result_;
+  std::exception_ptr &eptr_;
   update_job &job_;
   std::mutex &mutex_;
   std::condition_variable &output_cv_;
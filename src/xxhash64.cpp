@@ -1,7 +1,10 @@
 #include "xxhash64.h"
 #include "io/file_descriptor.h"
+#include "io/utils.h"
 #include "path.h"
 #include <array>
+#include <chrono>
+#include <cstring>
 #include <fcntl.h>
 #include <fstream>
 #include <sys/stat.h>
@@ -27,21 +30,198 @@ XXH64_hash_t hash_file(XXH64_hash_t seed, const std::string &file_path) {
   return hash.digest();
 }
 
+/**
+ * Version of the persisted hashes file format. Increment this each time the
+ * format changes, so that old files get ignored.
+ */
+static const char PERSISTED_VERSION = 1;
+
+/**
+ * How close to the moment we look at a file its modification time must be
+ * for it to be racy. This is large enough for the coarsest filesystems.
+ */
+static const unsigned long long RACY_WINDOW_NS = 2000000000;
+
+unsigned long long get_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+bool is_mtime_racy(unsigned long long mtime_ns, unsigned long long now_ns) {
+  return mtime_ns + RACY_WINDOW_NS >= now_ns;
+}
+
+file_hash_cache::file_hash_cache() : shards_(new shard[SHARD_COUNT]) {
+  for (size_t i = 0; i < SHARD_COUNT; ++i) shards_[i].dirty = false;
+}
+
+file_hash_cache::shard &
+file_hash_cache::get_shard_(const std::string &file_path) {
+  return shards_[std::hash<std::string>()(file_path) % SHARD_COUNT];
+}
+
 XXH64_hash_t file_hash_cache::hash(const std::string &file_path) {
   if (!is_path_absolute(file_path)) {
     throw std::runtime_error("expected absolute path");
   }
-  auto search = cache_.find(file_path);
-  if (search != cache_.end()) {
-    return search->second;
+  auto &target = get_shard_(file_path);
+  std::unique_lock<std::mutex> lock(target.mutex);
+  auto search = target.flights.find(file_path);
+  if (search != target.flights.end()) {
+    auto result = search->second->result;
+    lock.unlock();
+    return result.get();
+  }
+  auto own = std::make_shared<flight>();
+  own->result = own->promise.get_future().share();
+  target.flights.insert({file_path, own});
+  persisted_hash known{};
+  auto persisted = target.persisted.find(file_path);
+  bool has_known = persisted != target.persisted.end();
+  if (has_known) known = persisted->second;
+  lock.unlock();
+  try {
+    own->promise.set_value(compute_(target, file_path, has_known, known));
+  } catch (...) {
+    own->promise.set_exception(std::current_exception());
+    // Don't keep failures around, a later call may succeed.
+    lock.lock();
+    search = target.flights.find(file_path);
+    if (search != target.flights.end() && search->second == own) {
+      target.flights.erase(search);
+    }
+    lock.unlock();
+  }
+  return own->result.get();
+}
+
+unsigned long long file_hash_cache::compute_(shard &target,
+                                             const std::string &file_path,
+                                             bool has_known,
+                                             const persisted_hash &known) {
+  struct ::stat data;
+  if (io::stat(file_path.c_str(), &data) != 0) io::throw_errno();
+  persisted_hash entry{static_cast<unsigned long long>(data.st_dev),
+                       static_cast<unsigned long long>(data.st_ino),
+                       static_cast<unsigned long long>(data.st_size),
+                       io::get_mtime_ns(data), 0};
+  if (has_known && known.dev == entry.dev && known.ino == entry.ino &&
+      known.size == entry.size && known.mtime_ns == entry.mtime_ns) {
+    return known.hash;
   }
-  auto hash = upd::hash_file(0, file_path);
-  cache_.insert({file_path, hash});
-  return hash;
+  auto now_ns = get_now_ns();
+  entry.hash = upd::hash_file(0, file_path);
+  std::lock_guard<std::mutex> lock(target.mutex);
+  // We don't persist the hashes of racy files, as we couldn't tell when
+  // these change.
+  if (!is_mtime_racy(entry.mtime_ns, now_ns)) {
+    target.persisted[file_path] = entry;
+    target.dirty = true;
+  } else if (target.persisted.erase(file_path) > 0) {
+    target.dirty = true;
+  }
+  return entry.hash;
 }
 
 void file_hash_cache::invalidate(const std::string &file_path) {
-  cache_.erase(file_path);
+  auto &target = get_shard_(file_path);
+  std::lock_guard<std::mutex> lock(target.mutex);
+  target.flights.erase(file_path);
+  if (target.persisted.erase(file_path) > 0) target.dirty = true;
+}
+
+template <typename Value>
+static bool read_persisted(const char *&data, const char *end, Value &value) {
+  if (static_cast<size_t>(end - data) < sizeof(value)) return false;
+  std::memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return true;
+}
+
+void file_hash_cache::load(const std::string &file_path) {
+  io::file_descriptor fd;
+  try {
+    fd = io::open(file_path, O_RDONLY, 0);
+  } catch (std::system_error error) {
+    if (error.code() == std::errc::no_such_file_or_directory) return;
+    throw;
+  }
+  io::mapped_file file(fd);
+  const char *data = file.data();
+  const char *end = data + file.size();
+  if (data == end || *data != PERSISTED_VERSION) return;
+  ++data;
+  std::unordered_map<std::string, persisted_hash> entries;
+  while (data != end) {
+    unsigned int path_size;
+    if (!read_persisted(data, end, path_size)) return;
+    if (static_cast<size_t>(end - data) < path_size) return;
+    std::string path(data, path_size);
+    data += path_size;
+    persisted_hash entry;
+    if (!read_persisted(data, end, entry)) return;
+    entries[std::move(path)] = entry;
+  }
+  for (size_t i = 0; i < SHARD_COUNT; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    shards_[i].persisted.clear();
+    shards_[i].dirty = false;
+  }
+  for (auto &item : entries) {
+    auto &target = get_shard_(item.first);
+    std::lock_guard<std::mutex> lock(target.mutex);
+    target.persisted.insert(std::move(item));
+  }
+}
+
+void file_hash_cache::save(const std::string &file_path,
+                           const std::string &temp_file_path) {
+  bool dirty = false;
+  std::string content(1, PERSISTED_VERSION);
+  for (size_t i = 0; i < SHARD_COUNT; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    dirty = dirty || shards_[i].dirty;
+    for (auto const &item : shards_[i].persisted) {
+      unsigned int path_size = item.first.size();
+      content.append(reinterpret_cast<const char *>(&path_size),
+                     sizeof(path_size));
+      content.append(item.first);
+      content.append(reinterpret_cast<const char *>(&item.second),
+                     sizeof(item.second));
+    }
+  }
+  if (!dirty) return;
+  {
+    io::file_descriptor fd =
+        io::open(temp_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (size_t i = 0; i < content.size();) {
+      i += io::write(fd, content.data() + i, content.size() - i);
+    }
+  }
+  if (io::rename(temp_file_path.c_str(), file_path.c_str()) != 0) {
+    io::throw_errno();
+  }
+  for (size_t i = 0; i < SHARD_COUNT; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    shards_[i].dirty = false;
+  }
+}
+
+void file_hash_cache::drop_entries(
+    const std::function<bool(const std::string &)> &is_stale) {
+  for (size_t i = 0; i < SHARD_COUNT; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].mutex);
+    auto &persisted = shards_[i].persisted;
+    for (auto iter = persisted.begin(); iter != persisted.end();) {
+      if (!is_stale(iter->first)) {
+        ++iter;
+        continue;
+      }
+      iter = persisted.erase(iter);
+      shards_[i].dirty = true;
+    }
+  }
 }
 
 } // namespace upd
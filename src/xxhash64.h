@@ -1,7 +1,10 @@
 #pragma once
 
 #include "xxhash.h"
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -89,21 +92,92 @@ XXH64_hash_t hash(const std::unordered_map<T, R> &target) {
  */
 XXH64_hash_t hash_file(unsigned long long seed, const std::string &file_path);
 
+/**
+ * The current time, in nanoseconds since the epoch, like modification times.
+ */
+unsigned long long get_now_ns();
+
+/**
+ * Whether a file that has that modification time, looked at from `now_ns`
+ * onward, may have been modified right before or while we looked at it.
+ * Depending on the timestamp granularity of the filesystem, it could then get
+ * modified again without its modification time changing, so its stat data
+ * cannot tell us whether its content changed since.
+ */
+bool is_mtime_racy(unsigned long long mtime_ns, unsigned long long now_ns);
+
 /**
  * Many source files, such as C++ headers, have an impact on the compilation of
  * multiple object files at a time. So it's handy to cache the hashes for these
  * source files.
+ *
+ * The cache can also be persisted across invocations: each hash is then kept
+ * along with the device, inode, size and modification time of the file, and
+ * only reused as long as these stay the same.
+ *
+ * The cache is safe to use from several threads at once. Entries are split
+ * into shards so that threads rarely contend on the same lock. If several
+ * threads ask for the hash of the same file at the same time, the file is only
+ * read once, and all of them wait for that single result.
  */
 struct file_hash_cache {
+  file_hash_cache();
   unsigned long long hash(const std::string &file_path);
   /**
    * After a file was updated, or we detected changes on the filesystem, we
    * want to invalidate the digest we kept track of, as it likely changed.
    */
   void invalidate(const std::string &file_path);
+  /**
+   * Read hashes persisted by a previous invocation. A missing, corrupted, or
+   * outdated file is ignored.
+   */
+  void load(const std::string &file_path);
+  /**
+   * Persist the hashes, only if any changed since they were loaded. The
+   * content is first written to a temporary file that is then renamed, so
+   * that we never leave a partial file behind.
+   */
+  void save(const std::string &file_path, const std::string &temp_file_path);
+  /**
+   * Forget the persisted hashes of the files for which `is_stale` returns
+   * `true`, for example because they don't exist anymore. Otherwise, every
+   * file ever hashed would stay in the persisted file.
+   */
+  void drop_entries(const std::function<bool(const std::string &)> &is_stale);
 
 private:
-  std::unordered_map<std::string, unsigned long long> cache_;
+  struct persisted_hash {
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long size;
+    unsigned long long mtime_ns;
+    unsigned long long hash;
+  };
+
+  /**
+   * A hash that is being, or has been computed. The pointer identity lets us
+   * tell if an entry got invalidated and replaced in the meantime.
+   */
+  struct flight {
+    std::promise<unsigned long long> promise;
+    std::shared_future<unsigned long long> result;
+  };
+
+  struct shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<flight>> flights;
+    std::unordered_map<std::string, persisted_hash> persisted;
+    bool dirty;
+  };
+
+  static constexpr size_t SHARD_COUNT = 16;
+
+  shard &get_shard_(const std::string &file_path);
+  unsigned long long compute_(shard &target, const std::string &file_path,
+                              bool has_known, const persisted_hash &known);
+
+  std::unique_ptr<shard[]> shards_;
 };
 
 } // namespace upd
@@ -25,6 +25,7 @@ type Manifest = {
     only_for?: Array<string>,
     value_type: string,
     parse_function?: string,
+    implicit_value?: string | number,
   }>,
 };
 
@@ -102,6 +103,8 @@ function genSpec(manifest: Manifest) {
       valueType,
       onlyFor: option.only_for && option.only_for.map(c => cppNameOf(c)),
       parseFunction: option.parse_function,
+      implicitValue: option.implicit_value != null
+        ? option.implicit_value.toString() : null,
       type,
     };
   }).sort((a, b) => a.cppName > b.cppName ? 1 : -1);
@@ -166,26 +169,29 @@ function genCliCppParser(spec, stream, hppPath) {
     }
 `);
   for (const option of spec.options) {
-    stream.write(`    if (arg.compare(2, arg.size(), "${option.name}") == 0) {\n`);
-    if (option.onlyFor != null) {
-      stream.write(`      if (
-        ${option.onlyFor.map(c => {
-        return `result.command != command::${c}`;
-      }).join(' &&\n        ')}
-      ) {
-        throw unavailable_option_for_command_error();
-      }
-`);
+    const parseFunction = option.parseFunction || `parse_${option.valueType}`;
+    if (option.implicitValue != null) {
+      // Options with an implicit value only take an explicit one in the
+      // same argument, such as \`--foo=2\`.
+      const prefix = `--${option.name}=`;
+      stream.write(`    if (arg.compare(0, ${prefix.length}, "${prefix}") == 0) {\n`);
+      genOnlyForCheck(stream, option);
+      stream.write(`      result.${option.cppName} = ${parseFunction}(arg.substr(${prefix.length}));\n`);
+      stream.write(`      continue;\n`);
+      stream.write(`    }\n`);
     }
+    stream.write(`    if (arg.compare(2, arg.size(), "${option.name}") == 0) {\n`);
+    genOnlyForCheck(stream, option);
     if (option.valueType === 'bool') {
       stream.write(`      result.${option.cppName} = true;\n`);
+    } else if (option.implicitValue != null) {
+      stream.write(`      result.${option.cppName} = ${option.implicitValue};\n`);
     } else {
       stream.write(`      ++argv;
       if (*argv == nullptr) {
         throw option_requires_argument_error("--${option.name}");
       }
 `);
-      const parseFunction = option.parseFunction || `parse_${option.valueType}`;
       stream.write(`      result.${option.cppName} = ${parseFunction}(*argv);\n`);
     }
     stream.write(`      continue;\n`);
@@ -240,6 +246,18 @@ void output_help(const std::string& program, const command& command, bool use_co
   genNamespaceClose(spec.namespace, stream);
 }
 
+function genOnlyForCheck(stream, option) {
+  if (option.onlyFor == null) return;
+  stream.write(`      if (
+        ${option.onlyFor.map(c => {
+        return `result.command != command::${c}`;
+      }).join(' &&\n        ')}
+      ) {
+        throw unavailable_option_for_command_error();
+      }
+`);
+}
+
 function genOptionsListing(stream, indent, options) {
   for (const option of options) {
     stream.write(`${indent}os << ansi_sgr(1, use_color) << " --${option.name}";\n`);
@@ -253,6 +271,9 @@ function genOptionsListing(stream, indent, options) {
         stream.write(`{${desc}}`);
       }
       stream.write('"');
+    } else if (option.implicitValue != null) {
+      stream.write(' << "[=<value>]"');
+      headerLength += 10;
     } else if (option.type !== 'bool') {
       stream.write(' << " <value>"');
       headerLength += 8;